@@ -0,0 +1,18 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Secure Arena Allocator
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef PASSNOTE_ARENA_H
+#define PASSNOTE_ARENA_H
+
+struct arena_t;
+
+extern struct arena_t *arena_new ( void );
+extern void *arena_alloc ( struct arena_t *arena, size_t size );
+extern void arena_retain ( struct arena_t *arena );
+extern void arena_detach ( struct arena_t *arena );
+extern int arena_release ( void *mem, size_t size );
+
+#endif
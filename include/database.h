@@ -13,9 +13,23 @@ enum
     SEARCH_LEAF_NAME = 2,
     SEARCH_FIELD_NAME = 4,
     SEARCH_FIELD_VALUE = 8,
-    SEARCH_IGNORE_WHITESPACES = 16
+    SEARCH_IGNORE_WHITESPACES = 16,
+    SEARCH_FUZZY = 32
 };
 
+/* Trigram signature bits, a superset of the text that can match below a node */
+#define SEARCH_SIG_WORDS 4
+
+/* Pointers to the list elements in list order, for indexed and named lookups */
+struct sorted_index_t
+{
+    void **items;
+    size_t count;
+    size_t size;
+};
+
+struct leaf_t;
+
 struct field_t
 {
     struct field_t *prev;
@@ -23,6 +37,8 @@ struct field_t
     char *name;
     char *value;
     int modified;
+    int name_id;
+    struct leaf_t *leaf;
 };
 
 struct node_t
@@ -31,6 +47,9 @@ struct node_t
     struct node_t *next;
     char *name;
     int is_leaf;
+    int sig_valid;
+    struct node_t *parent;
+    uint64_t sig[SEARCH_SIG_WORDS];
 };
 
 struct leaf_t
@@ -39,8 +58,12 @@ struct leaf_t
     struct leaf_t *next;
     char *name;
     int is_leaf;
+    int sig_valid;
+    struct node_t *parent;
+    uint64_t sig[SEARCH_SIG_WORDS];
     struct field_t *fields_head;
     struct field_t *fields_tail;
+    struct sorted_index_t fields;
 };
 
 struct holder_t
@@ -49,8 +72,12 @@ struct holder_t
     struct holder_t *next;
     char *name;
     int is_leaf;
+    int sig_valid;
+    struct node_t *parent;
+    uint64_t sig[SEARCH_SIG_WORDS];
     struct node_t *children_head;
     struct node_t *children_tail;
+    struct sorted_index_t children;
 };
 
 struct database_stats_t
@@ -67,10 +94,17 @@ struct search_result_t
     int depth;
     char *name;
     const char *value;
+    const char *match_name;
+    int score;
+    size_t order;
 };
 
 extern int pack_tree ( const struct node_t *node, uint8_t ** mem, size_t *size );
 extern struct node_t *unpack_tree ( const uint8_t * mem, size_t size );
+extern struct node_t *unpack_tree_stream ( ssize_t ( *read ) ( void *, uint8_t *, size_t ),
+    void *ctx );
+extern struct node_t *unpack_tree_view ( ssize_t ( *read ) ( void *, uint8_t *, size_t ),
+    void *ctx, size_t size );
 extern void free_field ( struct field_t *field );
 extern void free_tree ( struct node_t *node );
 extern struct holder_t *new_holder ( const char *name );
@@ -100,6 +134,9 @@ extern void paste_as_tsv ( struct leaf_t *leaf, const char *input, struct databa
 extern int generate_password ( char *result, size_t size );
 extern int search_run ( struct node_t *tree, int options, const char *phrase,
     struct search_result_t **results, size_t *n );
+extern int search_refine ( int options, const char *phrase, unsigned int generation,
+    struct search_result_t *results, size_t *n );
+extern unsigned int get_tree_generation ( void );
 extern void search_free ( struct search_result_t **results, size_t *n );
 extern void sort_tree ( struct node_t *node );
 #endif
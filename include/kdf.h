@@ -0,0 +1,31 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Key Derivation
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef PASSNOTE_KDF_H
+#define PASSNOTE_KDF_H
+
+#define KDF_PBKDF2_SHA256 0
+#define KDF_SCRYPT 1
+
+#define KDF_DEFAULT_ROUNDS 50000
+
+struct kdf_params_t
+{
+    int id;
+    unsigned int rounds;
+    int log2_n;
+    int r;
+    int p;
+};
+
+extern void kdf_default_params ( struct kdf_params_t *params );
+extern int kdf_params_valid ( const struct kdf_params_t *params );
+extern int kdf_params_equal ( const struct kdf_params_t *a, const struct kdf_params_t *b );
+extern int kdf_derive_key ( const char *password, const uint8_t * salt, size_t salt_len,
+    const struct kdf_params_t *params, uint8_t * key, size_t key_size );
+extern int kdf_calibrate ( int id, unsigned int target_ms, struct kdf_params_t *params );
+
+#endif
@@ -0,0 +1,26 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Search Phrase Matching
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef PASSNOTE_MATCH_H
+#define PASSNOTE_MATCH_H
+
+/* Only ASCII is folded, so that saved signatures mean the same under any locale */
+#define MATCH_FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+#define MATCH_BLANK(c) ((c) == ' ' || (c) == '\t')
+
+struct match_t
+{
+    char *needle;
+    size_t len;
+    int ignore_blanks;
+};
+
+extern int match_init ( struct match_t *match, const char *needle, int ignore_blanks );
+extern int match_test ( const struct match_t *match, const char *haystack );
+extern int match_score ( const struct match_t *match, const char *haystack );
+extern void match_free ( struct match_t *match );
+
+#endif
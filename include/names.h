@@ -0,0 +1,14 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Interned Field Names
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef PASSNOTE_NAMES_H
+#define PASSNOTE_NAMES_H
+
+extern char *intern_name ( const char *name, size_t len, int *id );
+extern int lookup_name_id ( const char *name );
+extern void release_name ( const char *name );
+
+#endif
@@ -4,12 +4,38 @@
 
 #include "config.h"
 #include "database.h"
+#include "kdf.h"
 
 #ifndef PASSNOTE_STORAGE_H
 #define PASSNOTE_STORAGE_H
 
+#define CIPHER_AES256_CBC 0
+#define CIPHER_AES256_GCM 1
+#define CIPHER_CHACHA20_POLY1305 2
+
+#define CODEC_LZ4 0
+#define CODEC_ZSTD 1
+#define CODEC_LZ4HC 2
+#define CODEC_LZ4HC_LEVEL 9
+
+struct storage_options_t
+{
+    int kdf;
+    unsigned int unlock_ms;
+    int cipher;
+    int codec;
+    int level;
+    int zero_copy;
+};
+
 extern struct node_t *load_database ( const char *path, const char *password );
 extern int save_database ( const char *path, struct node_t *node, const char *password );
+extern int save_packed_database ( const char *path, const uint8_t * packed, size_t packed_len,
+    const char *password, unsigned int key_epoch );
+extern unsigned int get_key_cache_epoch ( void );
+extern void forget_cached_keys ( void );
+extern void storage_default_options ( struct storage_options_t *options );
+extern void set_storage_options ( const struct storage_options_t *options );
 extern char *read_plain_file ( const char *path );
 extern int write_plain_file ( const char *path, const char *content );
 
@@ -6,7 +6,11 @@
 
 #ifndef PASSNOTE_UTIL_H
 #define PASSNOTE_UTIL_H
+#define PARALLEL_MAX_THREADS 64
 extern void secure_free_mem ( void *mem, size_t size );
 extern void secure_free_string ( char *string );
+extern void *secure_alloc_locked ( size_t size );
+extern void secure_free_locked ( void *mem, size_t size );
 extern int random_bytes ( void *buffer, size_t length );
+extern int parallel_run ( size_t ntasks, int ( *task ) ( void *, size_t ), void *ctx );
 #endif
@@ -0,0 +1,313 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Secure Arena Allocator
+ * ------------------------------------------------------------------ */
+
+#include "arena.h"
+#include <pthread.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_MIN 65536
+#define ARENA_BLOCK_MAX 16777216
+
+/*
+ * A block is one mapping with an inaccessible guard page on each side,
+ * locked in memory when the limits allow it
+ */
+struct arena_block_t
+{
+    struct arena_block_t *next;
+    uint8_t *base;
+    size_t map_size;
+    uint8_t *mem;
+    size_t size;
+};
+
+/*
+ * Objects are bump allocated and never reused. The arena counts live
+ * objects plus one reference held by its creator, and is wiped and unmapped
+ * as a whole when the last of them is released. The count is only changed
+ * atomically, references are taken and dropped from any thread.
+ */
+struct arena_t
+{
+    struct arena_block_t *blocks;
+    size_t used;
+    size_t live;
+};
+
+/*
+ * Every block of every arena, sorted by address, so that a release finds
+ * its arena by bisection. Pointers outside the span of all blocks are heap
+ * memory and never take the lock.
+ */
+struct arena_range_t
+{
+    uintptr_t start;
+    uintptr_t end;
+    struct arena_t *arena;
+};
+
+static struct arena_range_t *ranges = NULL;
+static size_t ranges_count = 0;
+static size_t ranges_size = 0;
+static uintptr_t ranges_low = UINTPTR_MAX;
+static uintptr_t ranges_high = 0;
+static pthread_rwlock_t ranges_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Index of the first range that starts above the address */
+static size_t find_range ( uintptr_t addr )
+{
+    size_t low = 0;
+    size_t high = ranges_count;
+    size_t mid;
+
+    while ( low < high )
+    {
+        mid = low + ( high - low ) / 2;
+
+        if ( ranges[mid].start <= addr )
+        {
+            low = mid + 1;
+        } else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static void update_span ( void )
+{
+    __atomic_store_n ( &ranges_low, ranges_count ? ranges[0].start : UINTPTR_MAX,
+        __ATOMIC_RELEASE );
+    __atomic_store_n ( &ranges_high, ranges_count ? ranges[ranges_count - 1].end : 0,
+        __ATOMIC_RELEASE );
+}
+
+static int add_range ( struct arena_t *arena, const struct arena_block_t *block )
+{
+    size_t pos;
+    size_t size;
+    struct arena_range_t *resized;
+
+    pthread_rwlock_wrlock ( &ranges_lock );
+
+    if ( ranges_count == ranges_size )
+    {
+        size = ranges_size ? ranges_size << 1 : 16;
+
+        if ( !( resized = ( struct arena_range_t * ) realloc ( ranges,
+                    size * sizeof ( struct arena_range_t ) ) ) )
+        {
+            pthread_rwlock_unlock ( &ranges_lock );
+            return -1;
+        }
+
+        ranges = resized;
+        ranges_size = size;
+    }
+
+    pos = find_range ( ( uintptr_t ) block->mem );
+    memmove ( ranges + pos + 1, ranges + pos,
+        ( ranges_count - pos ) * sizeof ( struct arena_range_t ) );
+    ranges[pos].start = ( uintptr_t ) block->mem;
+    ranges[pos].end = ( uintptr_t ) block->mem + block->size;
+    ranges[pos].arena = arena;
+    ranges_count++;
+    update_span (  );
+
+    pthread_rwlock_unlock ( &ranges_lock );
+    return 0;
+}
+
+/* Called with the write lock held */
+static void remove_range ( const struct arena_block_t *block )
+{
+    size_t pos;
+
+    if ( ( pos = find_range ( ( uintptr_t ) block->mem ) )
+        && ranges[pos - 1].start == ( uintptr_t ) block->mem )
+    {
+        memmove ( ranges + pos - 1, ranges + pos,
+            ( ranges_count - pos ) * sizeof ( struct arena_range_t ) );
+        ranges_count--;
+    }
+}
+
+static struct arena_block_t *new_block ( size_t size )
+{
+    size_t page;
+    struct arena_block_t *block;
+
+    page = sysconf ( _SC_PAGESIZE );
+    size = ( size + page - 1 ) & ~( page - 1 );
+
+    if ( !( block = ( struct arena_block_t * ) calloc ( 1, sizeof ( struct arena_block_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    block->map_size = size + page * 2;
+
+    if ( ( block->base = ( uint8_t * ) mmap ( NULL, block->map_size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) ) == MAP_FAILED )
+    {
+        free ( block );
+        return NULL;
+    }
+
+    block->mem = block->base + page;
+    block->size = size;
+
+    if ( mprotect ( block->mem, block->size, PROT_READ | PROT_WRITE ) < 0 )
+    {
+        munmap ( block->base, block->map_size );
+        free ( block );
+        return NULL;
+    }
+
+    /* Large vaults may exceed the lock limit, keep going unlocked then */
+    mlock ( block->mem, block->size );
+
+#ifdef MADV_DONTDUMP
+    madvise ( block->mem, block->size, MADV_DONTDUMP );
+#endif
+
+    return block;
+}
+
+static void unmap_block ( struct arena_block_t *block )
+{
+    explicit_bzero ( block->mem, block->size );
+    munlock ( block->mem, block->size );
+    munmap ( block->base, block->map_size );
+    free ( block );
+}
+
+static void free_arena ( struct arena_t *arena )
+{
+    struct arena_block_t *block;
+    struct arena_block_t *next;
+
+    pthread_rwlock_wrlock ( &ranges_lock );
+
+    for ( block = arena->blocks; block; block = block->next )
+    {
+        remove_range ( block );
+    }
+
+    update_span (  );
+    pthread_rwlock_unlock ( &ranges_lock );
+
+    for ( block = arena->blocks; block; block = next )
+    {
+        next = block->next;
+        unmap_block ( block );
+    }
+
+    free ( arena );
+}
+
+struct arena_t *arena_new ( void )
+{
+    struct arena_t *arena;
+
+    if ( !( arena = ( struct arena_t * ) calloc ( 1, sizeof ( struct arena_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    arena->live = 1;
+    return arena;
+}
+
+void *arena_alloc ( struct arena_t *arena, size_t size )
+{
+    size_t block_size;
+    uint8_t *mem;
+    struct arena_block_t *block;
+
+    size = ( size + ARENA_ALIGN - 1 ) & ~( ( size_t ) ARENA_ALIGN - 1 );
+
+    /* Only the thread that builds the tree allocates or links blocks */
+    if ( !arena->blocks || arena->used + size > arena->blocks->size )
+    {
+        block_size = arena->blocks ? arena->blocks->size << 1 : ARENA_BLOCK_MIN;
+
+        if ( block_size > ARENA_BLOCK_MAX )
+        {
+            block_size = ARENA_BLOCK_MAX;
+        }
+
+        if ( !( block = new_block ( size > block_size ? size : block_size ) ) )
+        {
+            return NULL;
+        }
+
+        if ( add_range ( arena, block ) < 0 )
+        {
+            unmap_block ( block );
+            return NULL;
+        }
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = 0;
+    }
+
+    mem = arena->blocks->mem + arena->used;
+    arena->used += size;
+    arena_retain ( arena );
+    return mem;
+}
+
+void arena_retain ( struct arena_t *arena )
+{
+    __atomic_add_fetch ( &arena->live, 1, __ATOMIC_RELAXED );
+}
+
+static int arena_unref ( struct arena_t *arena )
+{
+    return !__atomic_sub_fetch ( &arena->live, 1, __ATOMIC_ACQ_REL );
+}
+
+void arena_detach ( struct arena_t *arena )
+{
+    if ( arena_unref ( arena ) )
+    {
+        free_arena ( arena );
+    }
+}
+
+int arena_release ( void *mem, size_t size )
+{
+    size_t pos;
+    uintptr_t addr = ( uintptr_t ) mem;
+    struct arena_t *arena = NULL;
+
+    if ( addr < __atomic_load_n ( &ranges_low, __ATOMIC_ACQUIRE )
+        || addr >= __atomic_load_n ( &ranges_high, __ATOMIC_ACQUIRE ) )
+    {
+        return FALSE;
+    }
+
+    pthread_rwlock_rdlock ( &ranges_lock );
+
+    if ( ( pos = find_range ( addr ) ) && addr < ranges[pos - 1].end )
+    {
+        arena = ranges[pos - 1].arena;
+    }
+
+    pthread_rwlock_unlock ( &ranges_lock );
+
+    if ( !arena )
+    {
+        return FALSE;
+    }
+
+    /* Wiped now so that edits leave nothing behind until teardown */
+    memset ( mem, '\0', size );
+    arena_detach ( arena );
+    return TRUE;
+}
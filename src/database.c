@@ -4,10 +4,35 @@
 
 #include "config.h"
 #include "database.h"
+#include "arena.h"
+#include "match.h"
+#include "names.h"
 #include "util.h"
 
 #define PASSNOTE_MAGIC { 'P', 'A', 'S', 'S', 'N', 'O', 'T', 'E' }
+#define PASSNOTE_MAGIC_V2 { 'P', 'A', 'S', 'S', 'N', 'O', 'T', '2' }
 #define PASSNOTE_MAGIC_SIZE 8
+#define PACK_VARINT_MAX 10
+#define PACK_STRING_MAX 0x40000000
+#define PACK_SIG_SIZE ( SEARCH_SIG_WORDS * 8 )
+#define PACK_SIG_MAX 4096
+#define SEARCH_TOP_MAX 200
+#define SEARCH_NAME_WEIGHT 2
+#define FIELD_SCAN_MAX 16
+
+/*
+ * Packed format v2, after the magic:
+ *   names  optional, tag 'D', varint count, names
+ *   sigs   optional, tag 'T', varint count, varint size, one search signature
+ *          per leaf in tree order, little endian words, text folded for ASCII
+ *          only
+ *   node   tag ('h' holder, 'l' leaf), name, varint count, children or fields
+ *   field  varint modified, name (varint index into names if present), value
+ *   string varint length, bytes without terminator
+ * Varints are unsigned LEB128. The tree is followed by eight zero bytes as
+ * in the original format, whose strings are NUL terminated and whose nodes
+ * carry '+' or '-' continuation markers instead of counts.
+ */
 
 struct linked2_t
 {
@@ -16,17 +41,50 @@ struct linked2_t
     char *name;
 };
 
+#define STREAM_CHUNK_SIZE 65536
+
+struct stream_t
+{
+    ssize_t ( *read ) ( void *ctx, uint8_t * mem, size_t len );
+    void *ctx;
+    size_t alloc;
+};
+
+struct name_dict_t
+{
+    const char **slots;
+    size_t *indices;
+    size_t mask;
+    const char **names;
+    size_t count;
+};
+
+struct packed_names_t
+{
+    char **names;
+    size_t *lens;
+    size_t count;
+};
+
 struct stack_t
 {
     uint8_t *mem;
     size_t len;
     size_t size;
+    struct stream_t *stream;
+    struct arena_t *arena;
+    int in_place;
+    struct name_dict_t *dict;
+    struct packed_names_t *names;
+    size_t nleaves;
 };
 
 struct search_ctx_t
 {
     int options;
-    const char *phrase;
+    uint64_t sig[SEARCH_SIG_WORDS];
+    struct match_t match;
+    size_t order;
     struct stack_t results;
     struct stack_t indices;
     struct stack_t namelens;
@@ -34,12 +92,140 @@ struct search_ctx_t
 };
 
 static struct node_t *unpack_node ( struct stack_t *stack, int *has_next );
+static struct node_t *unpack_node_v2 ( struct stack_t *stack );
 static int pack_node ( struct stack_t *stack, const struct node_t *node );
 static struct field_t *new_field_m ( const char *name, const char *value, int modified );
-static int merge_node ( struct node_t *tree, struct node_t *aux, struct database_stats_t *stats );
-static void append_child_no_check ( struct holder_t *holder, struct node_t *node, int *position );
-static void append_field_no_check ( struct leaf_t *leaf, struct field_t *field, int *position );
+static struct field_t *new_field_packed ( struct stack_t *stack, const char *name,
+    size_t name_len, size_t value_offset, size_t value_len, int modified );
+static struct node_t *new_node_packed ( struct stack_t *stack, int is_leaf, size_t size,
+    size_t name_offset, size_t name_len );
+static int merge_node ( struct node_t *tree, struct node_t *aux, struct database_stats_t *stats,
+    int parallel );
+static int append_child_no_check ( struct holder_t *holder, struct node_t *node, int *position );
+static int append_field_no_check ( struct leaf_t *leaf, struct field_t *field, int *position );
 static int search_generic ( struct node_t *node, struct search_ctx_t *ctx );
+static int search_subtrees ( struct holder_t *holder, struct search_ctx_t *ctx );
+static size_t sorted_index_bound ( const struct sorted_index_t *index, const char *name,
+    int upper );
+static void *sorted_index_find ( const struct sorted_index_t *index, const char *name );
+static void free_sorted_index ( struct sorted_index_t *index );
+
+/*
+ * Moves on with every change to a tree, through the signature invalidation
+ * all mutators go through. Search results borrow strings from the tree, they
+ * must not be refined once it has moved. Merges change trees from workers.
+ */
+static unsigned int tree_generation = 0;
+
+unsigned int get_tree_generation ( void )
+{
+    return __atomic_load_n ( &tree_generation, __ATOMIC_RELAXED );
+}
+
+/*
+ * Signatures set one bit per trigram of the case folded text with blanks
+ * left out, so any text a search phrase can match in either mode carries
+ * every bit of the phrase. A node signature also covers its subtree, so an
+ * edit clears the edited node and its ancestors. A node whose signature is
+ * valid has valid signatures below it, clearing stops at the first one that
+ * is already cleared.
+ */
+static void invalidate_signatures ( struct node_t *node )
+{
+    __atomic_add_fetch ( &tree_generation, 1, __ATOMIC_RELAXED );
+
+    for ( ; node && node->sig_valid; node = node->parent )
+    {
+        node->sig_valid = FALSE;
+    }
+}
+
+static void sig_add_text ( uint64_t * sig, const char *text )
+{
+    size_t len = 0;
+    uint32_t gram = 0;
+    uint32_t bit;
+    uint8_t c;
+
+    for ( ; ( c = ( uint8_t ) * text ); text++ )
+    {
+        if ( MATCH_BLANK ( c ) )
+        {
+            continue;
+        }
+
+        gram = ( ( gram << 8 ) | MATCH_FOLD ( c ) ) & 0xffffff;
+
+        if ( ++len >= 3 )
+        {
+            bit = ( ( uint64_t ) ( gram * 2654435761u ) * ( SEARCH_SIG_WORDS * 64 ) ) >> 32;
+            sig[bit >> 6] |= ( uint64_t ) 1 << ( bit & 63 );
+        }
+    }
+}
+
+static int sig_contains ( const uint64_t * sig, const uint64_t * subset )
+{
+    size_t i;
+
+    for ( i = 0; i < SEARCH_SIG_WORDS; i++ )
+    {
+        if ( ( sig[i] & subset[i] ) != subset[i] )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void leaf_signature ( const struct leaf_t *leaf, uint64_t * sig )
+{
+    struct field_t *field;
+
+    memset ( sig, '\0', SEARCH_SIG_WORDS * sizeof ( uint64_t ) );
+    sig_add_text ( sig, leaf->name );
+
+    for ( field = leaf->fields_head; field; field = field->next )
+    {
+        sig_add_text ( sig, field->name );
+        sig_add_text ( sig, field->value );
+    }
+}
+
+static const uint64_t *node_signature ( struct node_t *node )
+{
+    size_t i;
+    const uint64_t *sig;
+    struct node_t *child;
+
+    if ( node->sig_valid )
+    {
+        return node->sig;
+    }
+
+    if ( node->is_leaf )
+    {
+        leaf_signature ( ( struct leaf_t * ) node, node->sig );
+
+    } else
+    {
+        memset ( node->sig, '\0', sizeof ( node->sig ) );
+        sig_add_text ( node->sig, node->name );
+
+        for ( child = ( ( struct holder_t * ) node )->children_head; child; child = child->next )
+        {
+            sig = node_signature ( child );
+            for ( i = 0; i < SEARCH_SIG_WORDS; i++ )
+            {
+                node->sig[i] |= sig[i];
+            }
+        }
+    }
+
+    node->sig_valid = TRUE;
+    return node->sig;
+}
 
 static int stack_clone ( struct stack_t *src, struct stack_t *dst )
 {
@@ -66,32 +252,24 @@ static int push_binary ( struct stack_t *stack, const uint8_t * slice, size_t le
 {
     size_t reqlen;
     size_t sizex2;
-    uint8_t *mem_backup;
+    size_t size;
+    uint8_t *mem;
     reqlen = stack->len + len;
     if ( !stack->mem || reqlen > stack->size )
     {
         sizex2 = stack->size << 1;
-        stack->size = reqlen > sizex2 ? reqlen : sizex2;
-        if ( stack->mem )
-        {
-            if ( !( mem_backup = ( uint8_t * ) malloc ( stack->len ) ) )
-            {
-                secure_free_mem ( stack->mem, stack->len );
-                return -1;
-            }
-            memcpy ( mem_backup, stack->mem, stack->len );
-            secure_free_mem ( stack->mem, stack->len );
-            if ( !( stack->mem = ( uint8_t * ) malloc ( stack->size ) ) )
-            {
-                secure_free_mem ( mem_backup, stack->len );
-                return -1;
-            }
-            memcpy ( stack->mem, mem_backup, stack->len );
-            secure_free_mem ( mem_backup, stack->len );
-        } else if ( !( stack->mem = ( uint8_t * ) malloc ( stack->size ) ) )
+        size = reqlen > sizex2 ? reqlen : sizex2;
+        if ( !( mem = ( uint8_t * ) malloc ( size ) ) )
         {
             return -1;
         }
+        if ( stack->mem )
+        {
+            memcpy ( mem, stack->mem, stack->len );
+            secure_free_mem ( stack->mem, stack->size );
+        }
+        stack->mem = mem;
+        stack->size = size;
     }
     memcpy ( stack->mem + stack->len, slice, len );
     stack->len += len;
@@ -108,351 +286,1251 @@ static int push_string ( struct stack_t *stack, const char *string )
     return push_binary ( stack, ( const uint8_t * ) string, strlen ( string ) );
 }
 
-static int push_int ( struct stack_t *stack, int value )
+static int push_varint ( struct stack_t *stack, uint64_t value )
 {
-    char buffer[16];
-    if ( snprintf ( buffer, sizeof ( buffer ), "%x", value ) <= 0 )
+    size_t len = 0;
+    uint8_t array[PACK_VARINT_MAX];
+
+    do
     {
-        return -1;
+        array[len] = value & 0x7f;
+        value >>= 7;
+        array[len++] |= value ? 0x80 : 0;
     }
-    return push_string_null ( stack, buffer );
+    while ( value );
+
+    return push_binary ( stack, array, len );
 }
 
-static int pack_field ( struct stack_t *stack, const struct field_t *field )
+static size_t varint_size ( uint64_t value )
 {
-    uint8_t array[] = { 'f', 0 };
-    array[1] = field->next ? '+' : '-';
-    if ( push_binary ( stack, array, sizeof ( array ) ) < 0
-        || push_int ( stack, field->modified ) < 0
-        || push_string_null ( stack, field->name ) < 0
-        || push_string_null ( stack, field->value ) < 0 )
+    size_t len = 1;
+
+    while ( value >>= 7 )
     {
-        return -1;
+        len++;
     }
-    return 0;
+
+    return len;
 }
 
-static int pack_leaf ( struct stack_t *stack, const struct leaf_t *leaf )
+static size_t string_sized_size ( const char *string )
 {
-    struct field_t *ptr;
-    uint8_t array[] = { 'l', 0 };
+    size_t len;
 
-    array[1] = leaf->next ? '+' : '-';
-    if ( push_binary ( stack, array, sizeof ( array ) ) < 0
-        || push_string_null ( stack, leaf->name ) < 0 )
+    len = strlen ( string );
+    return varint_size ( len ) + len;
+}
+
+static size_t count_fields ( const struct node_t *node )
+{
+    size_t count = 0;
+    struct node_t *child;
+    struct field_t *field;
+
+    if ( node->is_leaf )
     {
-        return -1;
-    }
+        for ( field = ( ( const struct leaf_t * ) node )->fields_head; field; field = field->next )
+        {
+            count++;
+        }
 
-    for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
+    } else
     {
-        if ( pack_field ( stack, ptr ) < 0 )
+        for ( child = ( ( const struct holder_t * ) node )->children_head; child;
+            child = child->next )
         {
-            return -1;
+            count += count_fields ( child );
         }
     }
 
-    return 0;
+    return count;
 }
 
-static int pack_holder ( struct stack_t *stack, const struct holder_t *holder )
+/* Field names are interned, so the name pointer itself is the key */
+static size_t name_dict_slot ( const struct name_dict_t *dict, const char *name )
 {
-    struct node_t *ptr;
-    uint8_t array[2];
+    size_t slot;
 
-    array[0] = holder->children_head ? 'h' : 'e';
-    array[1] = holder->next ? '+' : '-';
-    if ( push_binary ( stack, array, sizeof ( array ) ) < 0
-        || push_string_null ( stack, holder->name ) < 0 )
-    {
-        return -1;
-    }
+    slot = ( ( ( uintptr_t ) name >> 4 ) * 2654435761u ) & dict->mask;
 
-    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    while ( dict->slots[slot] && dict->slots[slot] != name )
     {
-        if ( pack_node ( stack, ptr ) < 0 )
-        {
-            return -1;
-        }
+        slot = ( slot + 1 ) & dict->mask;
     }
 
-    return 0;
+    return slot;
 }
 
-static int pack_node ( struct stack_t *stack, const struct node_t *node )
+static void collect_names ( struct name_dict_t *dict, const struct node_t *node )
 {
+    size_t slot;
+    struct node_t *child;
+    struct field_t *field;
+
     if ( node->is_leaf )
     {
-        return pack_leaf ( stack, ( const struct leaf_t * ) node );
+        for ( field = ( ( const struct leaf_t * ) node )->fields_head; field; field = field->next )
+        {
+            if ( !dict->slots[slot = name_dict_slot ( dict, field->name )] )
+            {
+                dict->slots[slot] = field->name;
+                dict->indices[slot] = dict->count;
+                dict->names[dict->count++] = field->name;
+            }
+        }
+
     } else
     {
-        return pack_holder ( stack, ( const struct holder_t * ) node );
+        for ( child = ( ( const struct holder_t * ) node )->children_head; child;
+            child = child->next )
+        {
+            collect_names ( dict, child );
+        }
     }
 }
 
-int pack_tree ( const struct node_t *node, uint8_t ** mem, size_t *size )
+static void free_name_dict ( struct name_dict_t *dict )
 {
-    uint8_t magic[PASSNOTE_MAGIC_SIZE] = PASSNOTE_MAGIC;
-    uint8_t zeros[PASSNOTE_MAGIC_SIZE] = { 0 };
-    struct stack_t stack = { 0 };
+    free ( dict->slots );
+    free ( dict->indices );
+    free ( dict->names );
+}
+
+static int new_name_dict ( struct name_dict_t *dict, const struct node_t *node )
+{
+    size_t nfields;
+    size_t nslots = 16;
 
-    if ( push_binary ( &stack, magic, sizeof ( magic ) ) < 0
-        || pack_node ( &stack, node ) < 0 || push_binary ( &stack, zeros, sizeof ( zeros ) ) < 0 )
+    nfields = count_fields ( node );
+
+    while ( nslots < nfields * 2 )
     {
-        return -1;
+        nslots <<= 1;
     }
 
-    *mem = stack.mem;
-    *size = stack.len;
-    return 0;
-}
+    memset ( dict, '\0', sizeof ( struct name_dict_t ) );
+    dict->mask = nslots - 1;
 
-static int peek_binary ( struct stack_t *stack, uint8_t * slice, size_t len )
-{
-    if ( stack->len + len > stack->size )
+    if ( !( dict->slots = ( const char ** ) calloc ( nslots, sizeof ( const char * ) ) )
+        || !( dict->indices = ( size_t * ) calloc ( nslots, sizeof ( size_t ) ) )
+        || !( dict->names = ( const char ** ) calloc ( nfields ? nfields : 1,
+                sizeof ( const char * ) ) ) )
     {
-        errno = ERANGE;
+        free_name_dict ( dict );
         return -1;
     }
-    memcpy ( slice, stack->mem + stack->len, len );
+
+    collect_names ( dict, node );
     return 0;
 }
 
-static int scan_binary ( struct stack_t *stack, uint8_t * slice, size_t len )
+static size_t packed_names_size ( const struct name_dict_t *dict )
 {
-    if ( peek_binary ( stack, slice, len ) < 0 )
+    size_t i;
+    size_t size;
+
+    size = 1 + varint_size ( dict->count );
+
+    for ( i = 0; i < dict->count; i++ )
     {
-        return -1;
+        size += string_sized_size ( dict->names[i] );
     }
-    stack->len += len;
-    return 0;
-}
 
-static const char *peek_string ( struct stack_t *stack )
-{
-    return ( char * ) ( stack->mem + stack->len );
+    return size;
 }
 
-static int can_peek_string ( struct stack_t *stack )
+static size_t count_leaves ( const struct node_t *node )
 {
-    return stack->len + strlen ( ( char * ) stack->mem + stack->len ) < stack->size;
+    size_t count = 0;
+    struct node_t *child;
+
+    if ( node->is_leaf )
+    {
+        return 1;
+    }
+
+    for ( child = ( ( const struct holder_t * ) node )->children_head; child; child = child->next )
+    {
+        count += count_leaves ( child );
+    }
+
+    return count;
 }
 
-static void skip_string ( struct stack_t *stack )
+static size_t packed_sigs_size ( size_t nleaves )
 {
-    stack->len += strlen ( ( char * ) stack->mem + stack->len ) + 1;
+    return 1 + varint_size ( nleaves ) + varint_size ( PACK_SIG_SIZE ) + nleaves * PACK_SIG_SIZE;
 }
 
-static int scan_int ( struct stack_t *stack, int *value )
+static size_t packed_node_size ( const struct name_dict_t *dict, const struct node_t *node )
 {
-    if ( !can_peek_string ( stack ) )
+    size_t size;
+    size_t count = 0;
+    struct node_t *child;
+    struct field_t *field;
+
+    size = 1 + string_sized_size ( node->name );
+
+    if ( node->is_leaf )
     {
-        errno = EMSGSIZE;
-        return -1;
-    }
+        for ( field = ( ( const struct leaf_t * ) node )->fields_head; field; field = field->next )
+        {
+            size += varint_size ( ( unsigned int ) field->modified )
+                + varint_size ( dict->indices[name_dict_slot ( dict, field->name )] )
+                + string_sized_size ( field->value );
+            count++;
+        }
 
-    if ( sscanf ( peek_string ( stack ), "%x", ( unsigned int * ) value ) < 0 )
+    } else
     {
-        return -1;
+        for ( child = ( ( const struct holder_t * ) node )->children_head; child;
+            child = child->next )
+        {
+            size += packed_node_size ( dict, child );
+            count++;
+        }
     }
-    skip_string ( stack );
-    return 0;
+
+    return size + varint_size ( count );
 }
 
-static int unpack_leaf_has_field ( struct stack_t *stack )
+static int push_string_sized ( struct stack_t *stack, const char *string )
 {
-    uint8_t array[1];
-    if ( peek_binary ( stack, array, sizeof ( array ) ) < 0 )
+    size_t len;
+
+    len = strlen ( string );
+
+    if ( push_varint ( stack, len ) < 0 )
     {
         return -1;
     }
-    return array[0] == 'f';
+    return push_binary ( stack, ( const uint8_t * ) string, len );
 }
 
-static struct field_t *unpack_field ( struct stack_t *stack, int *has_next )
+static int pack_field ( struct stack_t *stack, const struct field_t *field )
 {
-    uint8_t array[2];
-    const char *name;
-    const char *value;
-    int modified;
-
-    if ( scan_binary ( stack, array, sizeof ( array ) ) < 0 || scan_int ( stack, &modified ) < 0 )
+    if ( push_varint ( stack, ( unsigned int ) field->modified ) < 0
+        || push_varint ( stack, stack->dict->indices[name_dict_slot ( stack->dict,
+                    field->name )] ) < 0 || push_string_sized ( stack, field->value ) < 0 )
     {
-        return NULL;
+        return -1;
     }
+    return 0;
+}
 
-    if ( array[0] != 'f' )
+static int pack_leaf ( struct stack_t *stack, const struct leaf_t *leaf )
+{
+    size_t count = 0;
+    struct field_t *ptr;
+    uint8_t tag = 'l';
+
+    for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
     {
-        errno = EINVAL;
-        return NULL;
+        count++;
     }
 
-    *has_next = array[1] == '+';
-
-    if ( !can_peek_string ( stack ) )
+    if ( push_binary ( stack, &tag, sizeof ( tag ) ) < 0
+        || push_string_sized ( stack, leaf->name ) < 0 || push_varint ( stack, count ) < 0 )
     {
-        errno = EMSGSIZE;
-        return NULL;
+        return -1;
     }
 
-    name = peek_string ( stack );
-    skip_string ( stack );
-
-    if ( !can_peek_string ( stack ) )
+    for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
     {
-        errno = EMSGSIZE;
-        return NULL;
+        if ( pack_field ( stack, ptr ) < 0 )
+        {
+            return -1;
+        }
     }
 
-    value = peek_string ( stack );
-    skip_string ( stack );
-
-    return new_field_m ( name, value, modified );
+    return 0;
 }
 
-static struct leaf_t *unpack_leaf ( struct stack_t *stack )
+static int pack_holder ( struct stack_t *stack, const struct holder_t *holder )
 {
-    int ret;
-    struct leaf_t *leaf;
-    struct field_t *field;
+    size_t count = 0;
+    struct node_t *ptr;
+    uint8_t tag = 'h';
 
-    if ( !can_peek_string ( stack ) )
+    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
     {
-        errno = EMSGSIZE;
-        return NULL;
+        count++;
     }
 
-    if ( !( leaf = new_leaf ( peek_string ( stack ) ) ) )
+    if ( push_binary ( stack, &tag, sizeof ( tag ) ) < 0
+        || push_string_sized ( stack, holder->name ) < 0 || push_varint ( stack, count ) < 0 )
     {
-        return NULL;
+        return -1;
+    }
+
+    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    {
+        if ( pack_node ( stack, ptr ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int pack_node ( struct stack_t *stack, const struct node_t *node )
+{
+    if ( node->is_leaf )
+    {
+        return pack_leaf ( stack, ( const struct leaf_t * ) node );
+    } else
+    {
+        return pack_holder ( stack, ( const struct holder_t * ) node );
+    }
+}
+
+static int pack_names ( struct stack_t *stack, const struct name_dict_t *dict )
+{
+    size_t i;
+    uint8_t tag = 'D';
+
+    if ( push_binary ( stack, &tag, sizeof ( tag ) ) < 0 || push_varint ( stack, dict->count ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < dict->count; i++ )
+    {
+        if ( push_string_sized ( stack, dict->names[i] ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int pack_node_sigs ( struct stack_t *stack, const struct node_t *node )
+{
+    size_t i;
+    uint64_t sig[SEARCH_SIG_WORDS];
+    uint8_t array[PACK_SIG_SIZE];
+    const struct leaf_t *leaf;
+    struct node_t *child;
+
+    if ( node->is_leaf )
+    {
+        /* Saving must not write to the tree, a stale signature is hashed aside */
+        leaf = ( const struct leaf_t * ) node;
+        if ( leaf->sig_valid )
+        {
+            memcpy ( sig, leaf->sig, sizeof ( sig ) );
+        } else
+        {
+            leaf_signature ( leaf, sig );
+        }
+
+        for ( i = 0; i < PACK_SIG_SIZE; i++ )
+        {
+            array[i] = sig[i >> 3] >> ( ( i & 7 ) << 3 );
+        }
+
+        return push_binary ( stack, array, sizeof ( array ) );
+    }
+
+    for ( child = ( ( const struct holder_t * ) node )->children_head; child; child = child->next )
+    {
+        if ( pack_node_sigs ( stack, child ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int pack_sigs ( struct stack_t *stack, const struct node_t *node )
+{
+    uint8_t tag = 'T';
+
+    if ( push_binary ( stack, &tag, sizeof ( tag ) ) < 0
+        || push_varint ( stack, stack->nleaves ) < 0 || push_varint ( stack, PACK_SIG_SIZE ) < 0 )
+    {
+        return -1;
+    }
+
+    return pack_node_sigs ( stack, node );
+}
+
+int pack_tree ( const struct node_t *node, uint8_t ** mem, size_t *size )
+{
+    uint8_t magic[PASSNOTE_MAGIC_SIZE] = PASSNOTE_MAGIC_V2;
+    uint8_t zeros[PASSNOTE_MAGIC_SIZE] = { 0 };
+    struct stack_t stack = { 0 };
+    struct name_dict_t dict;
+
+    if ( new_name_dict ( &dict, node ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Sized up front, so the pushes below never grow the buffer */
+    stack.dict = &dict;
+    stack.nleaves = count_leaves ( node );
+    stack.size = sizeof ( magic ) + packed_names_size ( &dict ) + packed_sigs_size ( stack.nleaves )
+        + packed_node_size ( &dict, node ) + sizeof ( zeros );
+
+    if ( !( stack.mem = ( uint8_t * ) malloc ( stack.size ) ) )
+    {
+        free_name_dict ( &dict );
+        return -1;
+    }
+
+    if ( push_binary ( &stack, magic, sizeof ( magic ) ) < 0 || pack_names ( &stack, &dict ) < 0
+        || pack_sigs ( &stack, node ) < 0 || pack_node ( &stack, node ) < 0
+        || push_binary ( &stack, zeros, sizeof ( zeros ) ) < 0 )
+    {
+        free_name_dict ( &dict );
+        secure_free_mem ( stack.mem, stack.size );
+        return -1;
+    }
+
+    free_name_dict ( &dict );
+    *mem = stack.mem;
+    *size = stack.len;
+    return 0;
+}
+
+static int stack_fill ( struct stack_t *stack, size_t len )
+{
+    ssize_t ret;
+    size_t alloc;
+    uint8_t *mem;
+    struct stream_t *stream = stack->stream;
+
+    while ( stack->len + len > stack->size )
+    {
+        if ( !stream )
+        {
+            errno = ERANGE;
+            return -1;
+        }
+
+        if ( stack->size == stream->alloc )
+        {
+            alloc = stream->alloc + ( len > STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE );
+            if ( !( mem = ( uint8_t * ) malloc ( alloc ) ) )
+            {
+                return -1;
+            }
+            if ( stack->mem )
+            {
+                memcpy ( mem, stack->mem, stack->size );
+                secure_free_mem ( stack->mem, stream->alloc );
+            }
+            stack->mem = mem;
+            stream->alloc = alloc;
+        }
+
+        if ( ( ret = stream->read ( stream->ctx, stack->mem + stack->size,
+                    stream->alloc - stack->size ) ) <= 0 )
+        {
+            if ( !ret )
+            {
+                errno = EMSGSIZE;
+            }
+            return -1;
+        }
+
+        stack->size += ret;
+    }
+
+    return 0;
+}
+
+static void stack_compact ( struct stack_t *stack )
+{
+    size_t left;
+
+    if ( stack->stream && stack->len && stack->len >= ( stack->stream->alloc >> 1 ) )
+    {
+        left = stack->size - stack->len;
+        memmove ( stack->mem, stack->mem + stack->len, left );
+        memset ( stack->mem + left, '\0', stack->len );
+        stack->size = left;
+        stack->len = 0;
+    }
+}
+
+static int peek_binary ( struct stack_t *stack, uint8_t * slice, size_t len )
+{
+    if ( stack_fill ( stack, len ) < 0 )
+    {
+        return -1;
+    }
+    memcpy ( slice, stack->mem + stack->len, len );
+    return 0;
+}
+
+static int scan_binary ( struct stack_t *stack, uint8_t * slice, size_t len )
+{
+    if ( peek_binary ( stack, slice, len ) < 0 )
+    {
+        return -1;
+    }
+    stack->len += len;
+    return 0;
+}
+
+static const char *peek_string ( struct stack_t *stack )
+{
+    return ( char * ) ( stack->mem + stack->len );
+}
+
+static int can_peek_string ( struct stack_t *stack )
+{
+    size_t scanned = 0;
+
+    while ( !stack->mem || !memchr ( stack->mem + stack->len + scanned, '\0',
+            stack->size - stack->len - scanned ) )
+    {
+        scanned = stack->mem ? stack->size - stack->len : 0;
+        if ( stack_fill ( stack, scanned + 1 ) < 0 )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void skip_string ( struct stack_t *stack )
+{
+    stack->len += strlen ( ( char * ) stack->mem + stack->len ) + 1;
+}
+
+static int scan_int ( struct stack_t *stack, int *value )
+{
+    if ( !can_peek_string ( stack ) )
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if ( sscanf ( peek_string ( stack ), "%x", ( unsigned int * ) value ) < 0 )
+    {
+        return -1;
+    }
+    skip_string ( stack );
+    return 0;
+}
+
+static int scan_varint ( struct stack_t *stack, uint64_t * value )
+{
+    int shift;
+    uint8_t byte;
+
+    *value = 0;
+
+    for ( shift = 0; shift < PACK_VARINT_MAX * 7; shift += 7 )
+    {
+        if ( stack_fill ( stack, 1 ) < 0 )
+        {
+            return -1;
+        }
+
+        byte = stack->mem[stack->len++];
+        *value |= ( uint64_t ) ( byte & 0x7f ) << shift;
+
+        if ( !( byte & 0x80 ) )
+        {
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static int scan_string_sized ( struct stack_t *stack, size_t *offset, size_t *len )
+{
+    uint64_t value;
+
+    if ( scan_varint ( stack, &value ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( value > PACK_STRING_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( stack_fill ( stack, value ) < 0 )
+    {
+        return -1;
+    }
+
+    *offset = stack->len;
+    *len = value;
+    stack->len += value;
+    return 0;
+}
+
+static int unpack_leaf_has_field ( struct stack_t *stack )
+{
+    uint8_t array[1];
+    if ( peek_binary ( stack, array, sizeof ( array ) ) < 0 )
+    {
+        return -1;
+    }
+    return array[0] == 'f';
+}
+
+static struct field_t *unpack_field ( struct stack_t *stack, int *has_next )
+{
+    uint8_t array[2];
+    size_t name_offset;
+    size_t value_offset;
+    int modified;
+
+    stack_compact ( stack );
+
+    if ( scan_binary ( stack, array, sizeof ( array ) ) < 0 || scan_int ( stack, &modified ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( array[0] != 'f' )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    *has_next = array[1] == '+';
+
+    if ( !can_peek_string ( stack ) )
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    name_offset = stack->len;
+    skip_string ( stack );
+
+    if ( !can_peek_string ( stack ) )
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    value_offset = stack->len;
+    skip_string ( stack );
+
+    return new_field_m ( ( char * ) stack->mem + name_offset, ( char * ) stack->mem + value_offset,
+        modified );
+}
+
+static struct leaf_t *unpack_leaf ( struct stack_t *stack )
+{
+    int ret;
+    struct leaf_t *leaf;
+    struct field_t *field;
+
+    if ( !can_peek_string ( stack ) )
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if ( !( leaf = new_leaf ( peek_string ( stack ) ) ) )
+    {
+        return NULL;
+    }
+
+    skip_string ( stack );
+
+    if ( ( ret = unpack_leaf_has_field ( stack ) ) < 0 )
+    {
+        free_tree ( ( struct node_t * ) leaf );
+        return NULL;
+    }
+
+    while ( ret )
+    {
+        if ( !( field = unpack_field ( stack, &ret ) ) )
+        {
+            free_tree ( ( struct node_t * ) leaf );
+            return NULL;
+        }
+        if ( append_field ( leaf, field ) < 0 )
+        {
+            free_tree ( ( struct node_t * ) leaf );
+            free_field ( field );
+            return NULL;
+        }
+    }
+
+    return leaf;
+}
+
+static struct holder_t *unpack_holder ( struct stack_t *stack, int empty )
+{
+    int has_more_children;
+    struct holder_t *holder;
+    struct node_t *child;
+
+    if ( !can_peek_string ( stack ) )
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    if ( !( holder = new_holder ( peek_string ( stack ) ) ) )
+    {
+        return NULL;
+    }
+
+    skip_string ( stack );
+    has_more_children = !empty;
+
+    while ( has_more_children )
+    {
+        if ( !( child = unpack_node ( stack, &has_more_children ) ) )
+        {
+            free_tree ( ( struct node_t * ) holder );
+            return NULL;
+        }
+        if ( append_child ( holder, child ) < 0 )
+        {
+            free_tree ( ( struct node_t * ) holder );
+            return NULL;
+        }
+    }
+
+    return holder;
+}
+
+static struct node_t *unpack_node ( struct stack_t *stack, int *has_next )
+{
+    uint8_t array[2];
+
+    stack_compact ( stack );
+
+    if ( scan_binary ( stack, array, sizeof ( array ) ) < 0 )
+    {
+        return NULL;
+    }
+
+    *has_next = array[1] == '+';
+
+    switch ( array[0] )
+    {
+    case 'h':
+        return ( struct node_t * ) unpack_holder ( stack, FALSE );
+    case 'e':
+        return ( struct node_t * ) unpack_holder ( stack, TRUE );
+    case 'l':
+        return ( struct node_t * ) unpack_leaf ( stack );
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+}
+
+static struct field_t *unpack_field_v2 ( struct stack_t *stack )
+{
+    uint64_t modified;
+    uint64_t index = 0;
+    size_t name_offset = 0;
+    size_t name_len;
+    size_t value_offset;
+    size_t value_len;
+
+    stack_compact ( stack );
+
+    if ( scan_varint ( stack, &modified ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( stack->names )
+    {
+        if ( scan_varint ( stack, &index ) < 0 )
+        {
+            return NULL;
+        }
+
+        if ( index >= stack->names->count )
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+
+        name_len = stack->names->lens[index];
+
+    } else if ( scan_string_sized ( stack, &name_offset, &name_len ) < 0 )
+    {
+        return NULL;
+    }
+
+    if ( scan_string_sized ( stack, &value_offset, &value_len ) < 0 )
+    {
+        return NULL;
+    }
+
+    return new_field_packed ( stack, stack->names ? stack->names->names[index]
+        : ( char * ) stack->mem + name_offset, name_len, value_offset, value_len,
+        ( int ) ( unsigned int ) modified );
+}
+
+static struct leaf_t *unpack_leaf_v2 ( struct stack_t *stack, size_t name_offset,
+    size_t name_len )
+{
+    uint64_t count;
+    struct leaf_t *leaf;
+    struct field_t *field;
+
+    if ( !( leaf = ( struct leaf_t * ) new_node_packed ( stack, TRUE, sizeof ( struct leaf_t ),
+                name_offset, name_len ) ) )
+    {
+        return NULL;
+    }
+
+    if ( scan_varint ( stack, &count ) < 0 )
+    {
+        free_tree ( ( struct node_t * ) leaf );
+        return NULL;
+    }
+
+    while ( count-- )
+    {
+        if ( !( field = unpack_field_v2 ( stack ) ) )
+        {
+            free_tree ( ( struct node_t * ) leaf );
+            return NULL;
+        }
+        if ( append_field ( leaf, field ) < 0 )
+        {
+            free_tree ( ( struct node_t * ) leaf );
+            free_field ( field );
+            return NULL;
+        }
+    }
+
+    return leaf;
+}
+
+static struct holder_t *unpack_holder_v2 ( struct stack_t *stack, size_t name_offset,
+    size_t name_len )
+{
+    uint64_t count;
+    struct holder_t *holder;
+    struct node_t *child;
+
+    if ( !( holder = ( struct holder_t * ) new_node_packed ( stack, FALSE,
+                sizeof ( struct holder_t ), name_offset, name_len ) ) )
+    {
+        return NULL;
+    }
+
+    if ( scan_varint ( stack, &count ) < 0 )
+    {
+        free_tree ( ( struct node_t * ) holder );
+        return NULL;
+    }
+
+    while ( count-- )
+    {
+        if ( !( child = unpack_node_v2 ( stack ) ) )
+        {
+            free_tree ( ( struct node_t * ) holder );
+            return NULL;
+        }
+        if ( append_child ( holder, child ) < 0 )
+        {
+            free_tree ( ( struct node_t * ) holder );
+            free_tree ( child );
+            return NULL;
+        }
+    }
+
+    return holder;
+}
+
+static struct node_t *unpack_node_v2 ( struct stack_t *stack )
+{
+    uint8_t tag;
+    size_t name_offset;
+    size_t name_len;
+
+    stack_compact ( stack );
+
+    if ( scan_binary ( stack, &tag, sizeof ( tag ) ) < 0
+        || scan_string_sized ( stack, &name_offset, &name_len ) < 0 )
+    {
+        return NULL;
     }
 
-    skip_string ( stack );
-
-    if ( ( ret = unpack_leaf_has_field ( stack ) ) < 0 )
+    switch ( tag )
     {
-        free_tree ( ( struct node_t * ) leaf );
+    case 'h':
+        return ( struct node_t * ) unpack_holder_v2 ( stack, name_offset, name_len );
+    case 'l':
+        return ( struct node_t * ) unpack_leaf_v2 ( stack, name_offset, name_len );
+    default:
+        errno = EINVAL;
         return NULL;
     }
+}
 
-    while ( ret )
+static void free_packed_names ( struct packed_names_t *names )
+{
+    size_t i;
+
+    for ( i = 0; i < names->count; i++ )
     {
-        if ( !( field = unpack_field ( stack, &ret ) ) )
+        release_name ( names->names[i] );
+    }
+
+    free ( names->names );
+    free ( names->lens );
+}
+
+static int unpack_names ( struct stack_t *stack, struct packed_names_t *names )
+{
+    int id;
+    uint64_t count;
+    size_t i;
+    size_t offset;
+    size_t len;
+
+    if ( scan_varint ( stack, &count ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( count > PACK_STRING_MAX )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !( names->names = ( char ** ) calloc ( count ? count : 1, sizeof ( char * ) ) )
+        || !( names->lens = ( size_t * ) calloc ( count ? count : 1, sizeof ( size_t ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        stack_compact ( stack );
+
+        if ( scan_string_sized ( stack, &offset, &len ) < 0
+            || !( names->names[i] = intern_name ( ( char * ) stack->mem + offset, len, &id ) ) )
         {
-            free_tree ( ( struct node_t * ) leaf );
-            return NULL;
+            return -1;
         }
-        if ( append_field ( leaf, field ) < 0 )
+
+        names->lens[i] = len;
+        names->count++;
+    }
+
+    return 0;
+}
+
+/* Signatures of another size are skipped, leaves are then hashed when searched */
+static int unpack_sigs ( struct stack_t *stack, uint8_t ** sigs, size_t *sigs_count )
+{
+    uint64_t count;
+    uint64_t size;
+    uint64_t i;
+
+    if ( scan_varint ( stack, &count ) < 0 || scan_varint ( stack, &size ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( count > PACK_STRING_MAX || size > PACK_SIG_MAX
+        || ( !stack->stream && count * size > stack->size - stack->len ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( size == PACK_SIG_SIZE )
+    {
+        if ( !( *sigs = ( uint8_t * ) malloc ( count ? count * size : 1 ) ) )
         {
-            free_tree ( ( struct node_t * ) leaf );
-            free_field ( field );
-            return NULL;
+            return -1;
         }
+        *sigs_count = count;
     }
 
-    return leaf;
+    for ( i = 0; i < count; i++ )
+    {
+        stack_compact ( stack );
+
+        if ( stack_fill ( stack, size ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( *sigs )
+        {
+            memcpy ( *sigs + i * size, stack->mem + stack->len, size );
+        }
+
+        stack->len += size;
+    }
+
+    return 0;
 }
 
-static struct holder_t *unpack_holder ( struct stack_t *stack, int empty )
+static int apply_sigs ( struct node_t *node, const uint8_t * sigs, size_t count, size_t *next )
 {
-    int has_more_children;
-    struct holder_t *holder;
+    size_t i;
     struct node_t *child;
 
-    if ( !can_peek_string ( stack ) )
+    if ( node->is_leaf )
     {
-        errno = EMSGSIZE;
-        return NULL;
+        if ( *next >= count )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memset ( node->sig, '\0', sizeof ( node->sig ) );
+
+        for ( i = 0; i < PACK_SIG_SIZE; i++ )
+        {
+            node->sig[i >> 3] |= ( uint64_t ) sigs[*next * PACK_SIG_SIZE + i] << ( ( i & 7 ) << 3 );
+        }
+
+        node->sig_valid = TRUE;
+        ( *next )++;
+        return 0;
     }
 
-    if ( !( holder = new_holder ( peek_string ( stack ) ) ) )
+    for ( child = ( ( struct holder_t * ) node )->children_head; child; child = child->next )
     {
-        return NULL;
+        if ( apply_sigs ( child, sigs, count, next ) < 0 )
+        {
+            return -1;
+        }
     }
 
-    skip_string ( stack );
-    has_more_children = !empty;
+    return 0;
+}
 
-    while ( has_more_children )
+static struct node_t *unpack_root_v2 ( struct stack_t *stack )
+{
+    uint8_t tag;
+    uint8_t *sigs = NULL;
+    size_t sigs_count = 0;
+    size_t sigs_next = 0;
+    struct node_t *result;
+    struct packed_names_t names = { 0 };
+
+    if ( peek_binary ( stack, &tag, sizeof ( tag ) ) < 0 )
     {
-        if ( !( child = unpack_node ( stack, &has_more_children ) ) )
+        return NULL;
+    }
+
+    /* Fields refer to the names section by index, each name is interned once */
+    if ( tag == 'D' )
+    {
+        stack->len += sizeof ( tag );
+
+        if ( unpack_names ( stack, &names ) < 0 )
         {
-            free_tree ( ( struct node_t * ) holder );
+            free_packed_names ( &names );
             return NULL;
         }
-        if ( append_child ( holder, child ) < 0 )
+
+        stack->names = &names;
+
+        if ( peek_binary ( stack, &tag, sizeof ( tag ) ) < 0 )
         {
-            free_tree ( ( struct node_t * ) holder );
+            stack->names = NULL;
+            free_packed_names ( &names );
             return NULL;
         }
     }
 
-    return holder;
+    /* Saved search signatures, so that loading does not hash every value */
+    if ( tag == 'T' )
+    {
+        stack->len += sizeof ( tag );
+
+        if ( unpack_sigs ( stack, &sigs, &sigs_count ) < 0 )
+        {
+            if ( sigs )
+            {
+                secure_free_mem ( sigs, sigs_count * PACK_SIG_SIZE );
+            }
+            stack->names = NULL;
+            free_packed_names ( &names );
+            return NULL;
+        }
+    }
+
+    result = unpack_node_v2 ( stack );
+
+    /* Applied once the tree is complete, building it counts as changes */
+    if ( result && sigs && ( apply_sigs ( result, sigs, sigs_count, &sigs_next ) < 0
+            || sigs_next != sigs_count ) )
+    {
+        free_tree ( result );
+        errno = EINVAL;
+        result = NULL;
+    }
+
+    if ( sigs )
+    {
+        secure_free_mem ( sigs, sigs_count * PACK_SIG_SIZE );
+    }
+
+    stack->names = NULL;
+    free_packed_names ( &names );
+    return result;
 }
 
-static struct node_t *unpack_node ( struct stack_t *stack, int *has_next )
+static struct node_t *unpack_root ( struct stack_t *stack )
 {
-    uint8_t array[2];
+    uint8_t magic[PASSNOTE_MAGIC_SIZE] = PASSNOTE_MAGIC;
+    uint8_t magic_v2[PASSNOTE_MAGIC_SIZE] = PASSNOTE_MAGIC_V2;
+    uint8_t magic_check[PASSNOTE_MAGIC_SIZE];
+    int has_next;
 
-    if ( scan_binary ( stack, array, sizeof ( array ) ) < 0 )
+    if ( scan_binary ( stack, magic_check, PASSNOTE_MAGIC_SIZE ) < 0 )
     {
         return NULL;
     }
 
-    *has_next = array[1] == '+';
+    if ( !memcmp ( magic_v2, magic_check, PASSNOTE_MAGIC_SIZE ) )
+    {
+        return unpack_root_v2 ( stack );
+    }
 
-    switch ( array[0] )
+    if ( memcmp ( magic, magic_check, PASSNOTE_MAGIC_SIZE ) )
     {
-    case 'h':
-        return ( struct node_t * ) unpack_holder ( stack, FALSE );
-    case 'e':
-        return ( struct node_t * ) unpack_holder ( stack, TRUE );
-    case 'l':
-        return ( struct node_t * ) unpack_leaf ( stack );
-    default:
         errno = EINVAL;
         return NULL;
     }
+
+    return unpack_node ( stack, &has_next );
 }
 
-struct node_t *unpack_tree ( const uint8_t * mem, size_t size )
+static struct node_t *unpack_buffer ( struct stack_t *stack )
 {
-    uint8_t magic[PASSNOTE_MAGIC_SIZE] = PASSNOTE_MAGIC;
-    uint8_t magic_check[PASSNOTE_MAGIC_SIZE];
     uint8_t zeros[PASSNOTE_MAGIC_SIZE] = { 0 };
-    int has_next;
-    struct node_t *result;
+
+    if ( stack->size < ( PASSNOTE_MAGIC_SIZE << 1 ) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ( memcmp ( stack->mem + stack->size - PASSNOTE_MAGIC_SIZE, zeros, PASSNOTE_MAGIC_SIZE ) )
+    {
+        errno = EACCES;
+        return NULL;
+    }
+
+    return unpack_root ( stack );
+}
+
+struct node_t *unpack_tree ( const uint8_t * mem, size_t size )
+{
     struct stack_t stack = { 0 };
+    struct node_t *result;
 
     stack.mem = ( uint8_t * ) mem;
     stack.len = 0;
     stack.size = size;
+    stack.arena = arena_new (  );
+    result = unpack_buffer ( &stack );
 
-    if ( scan_binary ( &stack, magic_check, PASSNOTE_MAGIC_SIZE ) < 0 )
+    if ( stack.arena )
     {
-        return NULL;
+        arena_detach ( stack.arena );
     }
 
-    if ( memcmp ( magic, magic_check, PASSNOTE_MAGIC_SIZE ) )
+    return result;
+}
+
+struct node_t *unpack_tree_view ( ssize_t ( *read ) ( void *, uint8_t *, size_t ), void *ctx,
+    size_t size )
+{
+    ssize_t ret;
+    struct stack_t stack = { 0 };
+    struct node_t *result = NULL;
+
+    if ( !( stack.arena = arena_new (  ) ) )
     {
-        errno = EINVAL;
         return NULL;
     }
 
-    if ( stack.size < ( PASSNOTE_MAGIC_SIZE << 1 ) )
+    /* The buffer stays in the arena as backing store for the string views */
+    if ( ( stack.mem = ( uint8_t * ) arena_alloc ( stack.arena, size ) ) )
     {
-        return NULL;
+        while ( stack.len < size && ( ret = read ( ctx, stack.mem + stack.len,
+                    size - stack.len ) ) > 0 )
+        {
+            stack.len += ret;
+        }
+
+        if ( stack.len == size )
+        {
+            stack.len = 0;
+            stack.size = size;
+            stack.in_place = TRUE;
+            result = unpack_buffer ( &stack );
+
+        } else
+        {
+            errno = EMSGSIZE;
+        }
+
+        /* Views hold their own references, the bytes between them are not needed */
+        arena_release ( stack.mem, 0 );
     }
 
-    if ( memcmp ( stack.mem + stack.size - PASSNOTE_MAGIC_SIZE, zeros, PASSNOTE_MAGIC_SIZE ) )
+    arena_detach ( stack.arena );
+    return result;
+}
+
+struct node_t *unpack_tree_stream ( ssize_t ( *read ) ( void *, uint8_t *, size_t ), void *ctx )
+{
+    uint8_t zeros[PASSNOTE_MAGIC_SIZE] = { 0 };
+    uint8_t zeros_check[PASSNOTE_MAGIC_SIZE];
+    struct node_t *result;
+    struct stream_t stream = { 0 };
+    struct stack_t stack = { 0 };
+
+    stream.read = read;
+    stream.ctx = ctx;
+    stack.stream = &stream;
+    stack.arena = arena_new (  );
+
+    if ( ( result = unpack_root ( &stack ) ) )
     {
-        errno = EACCES;
-        return NULL;
+        if ( scan_binary ( &stack, zeros_check, PASSNOTE_MAGIC_SIZE ) < 0
+            || memcmp ( zeros_check, zeros, PASSNOTE_MAGIC_SIZE ) )
+        {
+            errno = EACCES;
+            free_tree ( result );
+            result = NULL;
+        }
     }
 
-    if ( !( result = unpack_node ( &stack, &has_next ) ) )
+    if ( stack.mem )
     {
-        return NULL;
+        secure_free_mem ( stack.mem, stream.alloc );
+    }
+
+    if ( stack.arena )
+    {
+        arena_detach ( stack.arena );
     }
 
     return result;
@@ -460,7 +1538,7 @@ struct node_t *unpack_tree ( const uint8_t * mem, size_t size )
 
 void free_field ( struct field_t *field )
 {
-    secure_free_string ( field->name );
+    release_name ( field->name );
     secure_free_string ( field->value );
     secure_free_mem ( field, sizeof ( struct field_t ) );
 }
@@ -490,6 +1568,7 @@ static void free_fields ( struct leaf_t *leaf )
         next = ptr->next;
         free_field ( ptr );
     }
+    free_sorted_index ( &leaf->fields );
 }
 
 static void free_children ( struct holder_t *holder )
@@ -501,6 +1580,7 @@ static void free_children ( struct holder_t *holder )
         next = ptr->next;
         free_tree ( ptr );
     }
+    free_sorted_index ( &holder->children );
 }
 
 void free_tree ( struct node_t *node )
@@ -555,36 +1635,90 @@ static char *new_string_trimmed ( const char *input )
         input++;
     }
 
-    end = input + strlen ( input );
+    end = input + strlen ( input );
+
+    while ( input + 1 < end && can_trim_character ( end[-1] ) )
+    {
+        end--;
+    }
+
+    len = end - input;
+
+    if ( !( result = ( char * ) malloc ( len + 1 ) ) )
+    {
+        return NULL;
+    }
+
+    memcpy ( result, input, len );
+    result[len] = '\0';
+
+    return result;
+}
+
+static struct node_t *new_node ( int is_leaf, size_t size, const char *name )
+{
+    struct node_t *node;
+
+    if ( !( node = ( struct node_t * ) calloc ( 1, size ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( node->name = new_string_trimmed ( name ) ) )
+    {
+        free_node ( node );
+        return NULL;
+    }
+
+    node->is_leaf = is_leaf;
+    return node;
+}
+
+/* Loaded trees come from an arena when one is available, edits use the heap */
+static void *new_mem ( struct arena_t *arena, size_t size )
+{
+    return arena ? arena_alloc ( arena, size ) : calloc ( 1, size );
+}
+
+/*
+ * Packed strings are stored trimmed, so they are taken as they are. In place
+ * unpacking moves each one over the last byte of its length and terminates
+ * it, leaving a view into the arena held buffer instead of a copy.
+ */
+static char *new_string_packed ( struct stack_t *stack, size_t offset, size_t len )
+{
+    char *result;
 
-    while ( input + 1 < end && can_trim_character ( end[-1] ) )
+    if ( stack->in_place )
     {
-        end--;
+        result = ( char * ) stack->mem + offset - 1;
+        memmove ( result, result + 1, len );
+        result[len] = '\0';
+        arena_retain ( stack->arena );
+        return result;
     }
 
-    len = end - input;
-
-    if ( !( result = ( char * ) malloc ( len + 1 ) ) )
+    if ( !( result = ( char * ) new_mem ( stack->arena, len + 1 ) ) )
     {
         return NULL;
     }
 
-    memcpy ( result, input, len );
+    memcpy ( result, stack->mem + offset, len );
     result[len] = '\0';
-
     return result;
 }
 
-static struct node_t *new_node ( int is_leaf, size_t size, const char *name )
+static struct node_t *new_node_packed ( struct stack_t *stack, int is_leaf, size_t size,
+    size_t name_offset, size_t name_len )
 {
     struct node_t *node;
 
-    if ( !( node = ( struct node_t * ) calloc ( 1, size ) ) )
+    if ( !( node = ( struct node_t * ) new_mem ( stack->arena, size ) ) )
     {
         return NULL;
     }
 
-    if ( !( node->name = new_string_trimmed ( name ) ) )
+    if ( !( node->name = new_string_packed ( stack, name_offset, name_len ) ) )
     {
         free_node ( node );
         return NULL;
@@ -608,27 +1742,32 @@ static int find_child_by_name ( const struct holder_t *holder, const char *name,
     struct node_t **found )
 {
     char *name_trimmed;
-    struct node_t *ptr;
 
     if ( !( name_trimmed = new_string_trimmed ( name ) ) )
     {
         return -1;
     }
 
-    *found = NULL;
+    *found = ( struct node_t * ) sorted_index_find ( &holder->children, name_trimmed );
 
-    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    secure_free_string ( name_trimmed );
+
+    return 0;
+}
+
+static char *new_name_trimmed ( const char *name, int *id )
+{
+    char *name_trimmed;
+    char *result;
+
+    if ( !( name_trimmed = new_string_trimmed ( name ) ) )
     {
-        if ( !strcasecmp ( name_trimmed, ptr->name ) )
-        {
-            *found = ptr;
-            break;
-        }
+        return NULL;
     }
 
+    result = intern_name ( name_trimmed, strlen ( name_trimmed ), id );
     secure_free_string ( name_trimmed );
-
-    return 0;
+    return result;
 }
 
 static struct field_t *new_field_m ( const char *name, const char *value, int modified )
@@ -640,7 +1779,7 @@ static struct field_t *new_field_m ( const char *name, const char *value, int mo
         return NULL;
     }
 
-    if ( !( field->name = new_string_trimmed ( name ) ) )
+    if ( !( field->name = new_name_trimmed ( name, &field->name_id ) ) )
     {
         free_field ( field );
         return NULL;
@@ -656,15 +1795,75 @@ static struct field_t *new_field_m ( const char *name, const char *value, int mo
     return field;
 }
 
+static struct field_t *new_field_packed ( struct stack_t *stack, const char *name,
+    size_t name_len, size_t value_offset, size_t value_len, int modified )
+{
+    struct field_t *field;
+
+    if ( !( field = ( struct field_t * ) new_mem ( stack->arena, sizeof ( struct field_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( field->name = intern_name ( name, name_len, &field->name_id ) ) )
+    {
+        free_field ( field );
+        return NULL;
+    }
+
+    if ( !( field->value = new_string_packed ( stack, value_offset, value_len ) ) )
+    {
+        free_field ( field );
+        return NULL;
+    }
+
+    field->modified = modified;
+    return field;
+}
+
 struct field_t *new_field ( const char *name, const char *value )
 {
     return new_field_m ( name, value, now (  ) );
 }
 
+/*
+ * Fields of one name share its interned id. Short leaves are scanned on ids
+ * alone; ids do not follow the name order, so longer ones are bisected on
+ * the folded name and the field found there is matched on its id.
+ */
+static struct field_t *find_field_by_id ( const struct leaf_t *leaf, const char *name, int id )
+{
+    size_t i;
+    struct field_t *field;
+
+    if ( leaf->fields.count <= FIELD_SCAN_MAX )
+    {
+        for ( i = 0; i < leaf->fields.count; i++ )
+        {
+            if ( ( field = ( struct field_t * ) leaf->fields.items[i] )->name_id == id )
+            {
+                return field;
+            }
+        }
+
+        return NULL;
+    }
+
+    i = sorted_index_bound ( &leaf->fields, name, FALSE );
+
+    if ( i < leaf->fields.count
+        && ( field = ( struct field_t * ) leaf->fields.items[i] )->name_id == id )
+    {
+        return field;
+    }
+
+    return NULL;
+}
+
 int find_field_by_name ( const struct leaf_t *leaf, const char *name, struct field_t **found )
 {
+    int id;
     char *name_trimmed;
-    struct field_t *ptr;
 
     if ( !( name_trimmed = new_string_trimmed ( name ) ) )
     {
@@ -673,13 +1872,10 @@ int find_field_by_name ( const struct leaf_t *leaf, const char *name, struct fie
 
     *found = NULL;
 
-    for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
+    /* A name that was never interned cannot be on any field */
+    if ( ( id = lookup_name_id ( name_trimmed ) ) )
     {
-        if ( !strcasecmp ( name_trimmed, ptr->name ) )
-        {
-            *found = ptr;
-            break;
-        }
+        *found = find_field_by_id ( leaf, name_trimmed, id );
     }
 
     secure_free_string ( name_trimmed );
@@ -699,117 +1895,387 @@ int edit_field ( struct field_t *field, const char *value )
     secure_free_string ( field->value );
     field->value = value_alloc;
     field->modified = now (  );
+    invalidate_signatures ( ( struct node_t * ) field->leaf );
     return 0;
 }
 
-static void linked2_insert ( struct linked2_t **head, struct linked2_t **tail,
-    struct linked2_t *node, int *position )
+#define SORTED_INDEX_MIN 16
+#define SORT_PARALLEL_MIN 16384
+#define SORT_TASK_WEIGHT 4096
+
+/*
+ * Children and fields stay on their sorted lists for iteration, the index
+ * mirrors the list order so that positions and names resolve by bisection
+ */
+static size_t sorted_index_bound ( const struct sorted_index_t *index, const char *name,
+    int upper )
 {
-    int new_position = 0;
-    struct linked2_t *successor;
+    int cmp;
+    size_t mid;
+    size_t lo = 0;
+    size_t hi = index->count;
 
-    if ( !*head )
+    while ( lo < hi )
     {
-        node->prev = NULL;
-        node->next = NULL;
-        *head = node;
-        *tail = node;
+        mid = lo + ( ( hi - lo ) >> 1 );
+        cmp = strcasecmp ( ( ( struct linked2_t * ) index->items[mid] )->name, name );
+        if ( cmp < 0 || ( upper && !cmp ) )
+        {
+            lo = mid + 1;
+        } else
+        {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void *sorted_index_find ( const struct sorted_index_t *index, const char *name )
+{
+    size_t i;
 
-    } else if ( strcasecmp ( node->name, ( *head )->name ) < 0 )
+    i = sorted_index_bound ( index, name, FALSE );
+
+    if ( i < index->count && !strcasecmp ( ( ( struct linked2_t * ) index->items[i] )->name,
+            name ) )
     {
-        node->prev = NULL;
-        node->next = *head;
-        ( *head )->prev = node;
-        *head = node;
+        return index->items[i];
+    }
+
+    return NULL;
+}
+
+static void free_sorted_index ( struct sorted_index_t *index )
+{
+    free ( index->items );
+    index->items = NULL;
+    index->count = 0;
+    index->size = 0;
+}
+
+static int sorted_index_reserve ( struct sorted_index_t *index, size_t count )
+{
+    size_t size;
+    void **items;
 
-    } else if ( strcasecmp ( node->name, ( *tail )->name ) > 0 )
+    if ( count <= index->size )
     {
-        node->prev = *tail;
-        node->next = NULL;
-        ( *tail )->next = node;
-        *tail = node;
-        for ( successor = *head; successor; successor = successor->next )
-        {
-            if ( successor->next )
-            {
-                new_position++;
-            }
-        }
+        return 0;
+    }
+
+    for ( size = index->size ? index->size : SORTED_INDEX_MIN; size < count; size <<= 1 )
+    {
+    }
+
+    if ( !( items = ( void ** ) realloc ( index->items, size * sizeof ( void * ) ) ) )
+    {
+        return -1;
+    }
+
+    index->items = items;
+    index->size = size;
+    return 0;
+}
+
+/* Rebuilds the list links from the index after a bulk change */
+static void linked2_relink ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index )
+{
+    size_t i;
+    struct linked2_t *ptr;
+
+    for ( i = 0; i < index->count; i++ )
+    {
+        ptr = ( struct linked2_t * ) index->items[i];
+        ptr->prev = i ? ( struct linked2_t * ) index->items[i - 1] : NULL;
+        ptr->next = i + 1 < index->count ? ( struct linked2_t * ) index->items[i + 1] : NULL;
+    }
 
+    *head = index->count ? ( struct linked2_t * ) index->items[0] : NULL;
+    *tail = index->count ? ( struct linked2_t * ) index->items[index->count - 1] : NULL;
+}
+
+static int linked2_insert ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index, struct linked2_t *node, int *position )
+{
+    size_t i;
+
+    if ( sorted_index_reserve ( index, index->count + 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    i = sorted_index_bound ( index, node->name, TRUE );
+
+    node->prev = i ? ( struct linked2_t * ) index->items[i - 1] : NULL;
+    node->next = i < index->count ? ( struct linked2_t * ) index->items[i] : NULL;
+
+    if ( node->prev )
+    {
+        node->prev->next = node;
     } else
     {
-        successor = ( *head )->next;
-        while ( successor && strcasecmp ( successor->name, node->name ) < 0 )
-        {
-            successor = successor->next;
-            new_position++;
-        }
-        new_position++;
-        if ( !successor )
-        {
-            return;
-        }
-        successor->prev->next = node;
-        node->prev = successor->prev;
-        successor->prev = node;
-        node->next = successor;
+        *head = node;
+    }
+
+    if ( node->next )
+    {
+        node->next->prev = node;
+    } else
+    {
+        *tail = node;
     }
 
+    memmove ( index->items + i + 1, index->items + i, ( index->count - i ) * sizeof ( void * ) );
+    index->items[i] = node;
+    index->count++;
+
     if ( position )
     {
-        *position = new_position;
+        *position = i;
     }
+
+    return 0;
 }
 
 static void linked2_unlink ( struct linked2_t **head, struct linked2_t **tail,
-    struct linked2_t *node )
+    struct sorted_index_t *index, struct linked2_t *node )
 {
-    if ( *head )
+    size_t i;
+
+    /* Equal names may sit next to each other, the pointer decides */
+    for ( i = sorted_index_bound ( index, node->name, FALSE ); i < index->count; i++ )
     {
-        if ( *head == node )
+        if ( index->items[i] == node )
         {
-            *head = node->next;
+            break;
         }
+    }
+
+    if ( i >= index->count )
+    {
+        return;
+    }
+
+    memmove ( index->items + i, index->items + i + 1,
+        ( index->count - i - 1 ) * sizeof ( void * ) );
+    index->count--;
+
+    if ( *head == node )
+    {
+        *head = node->next;
+    }
+
+    if ( *tail == node )
+    {
+        *tail = node->prev;
+    }
+
+    if ( node->next )
+    {
+        node->next->prev = node->prev;
+    }
+
+    if ( node->prev )
+    {
+        node->prev->next = node->next;
+    }
+}
 
-        if ( *tail == node )
+/* Merges a sorted batch in with one pass from the back, equal names go last */
+static int linked2_insert_batch ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index, void **batch, size_t n )
+{
+    size_t i;
+    size_t j;
+    size_t k;
+
+    if ( sorted_index_reserve ( index, index->count + n ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = index->count, j = n, k = index->count + n; j; )
+    {
+        if ( i && strcasecmp ( ( ( struct linked2_t * ) index->items[i - 1] )->name,
+                ( ( struct linked2_t * ) batch[j - 1] )->name ) > 0 )
+        {
+            index->items[--k] = index->items[--i];
+        } else
         {
-            *tail = node->prev;
+            index->items[--k] = batch[--j];
         }
+    }
+
+    index->count += n;
+    linked2_relink ( head, tail, index );
+    return 0;
+}
+
+/* Drops a batch taken from the index in index order */
+static void linked2_remove_batch ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index, void **batch, size_t n )
+{
+    size_t i;
+    size_t j;
+    size_t k;
 
-        if ( node->next )
+    for ( i = 0, j = 0, k = 0; i < index->count; i++ )
+    {
+        if ( j < n && index->items[i] == batch[j] )
         {
-            node->next->prev = node->prev;
+            j++;
+        } else
+        {
+            index->items[k++] = index->items[i];
         }
+    }
+
+    index->count = k;
+    linked2_relink ( head, tail, index );
+}
+
+struct sort_entry_t
+{
+    const char *key;
+    struct linked2_t *item;
+};
+
+static void merge_sort_entries ( struct sort_entry_t *entries, struct sort_entry_t *tmp, size_t n )
+{
+    size_t i;
+    size_t j;
+    size_t k;
+    size_t mid;
+
+    if ( n < 2 )
+    {
+        return;
+    }
+
+    mid = n >> 1;
+    merge_sort_entries ( entries, tmp, mid );
+    merge_sort_entries ( entries + mid, tmp + mid, n - mid );
+
+    /* Lists are kept sorted on insert, so halves are usually in order already */
+    if ( strcmp ( entries[mid - 1].key, entries[mid].key ) <= 0 )
+    {
+        return;
+    }
+
+    for ( i = 0, j = mid, k = 0; i < mid && j < n; k++ )
+    {
+        tmp[k] = strcmp ( entries[j].key, entries[i].key ) < 0 ? entries[j++] : entries[i++];
+    }
+
+    while ( i < mid )
+    {
+        tmp[k++] = entries[i++];
+    }
+
+    while ( j < n )
+    {
+        tmp[k++] = entries[j++];
+    }
 
-        if ( node->prev )
+    memcpy ( entries, tmp, n * sizeof ( struct sort_entry_t ) );
+}
+
+/*
+ * Names are case folded once into a single buffer, then a stable merge sort
+ * compares the folded keys bytewise, which orders them as strcasecmp does
+ */
+static int linked2_sort_keys ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index )
+{
+    size_t i;
+    size_t len;
+    size_t keys_size = 0;
+    char *keys;
+    char *key;
+    struct sort_entry_t *entries;
+    struct linked2_t *ptr;
+
+    for ( ptr = *head; ptr; ptr = ptr->next )
+    {
+        keys_size += strlen ( ptr->name ) + 1;
+    }
+
+    if ( !( keys = ( char * ) malloc ( keys_size ) ) )
+    {
+        return -1;
+    }
+
+    if ( !( entries = ( struct sort_entry_t * ) malloc ( index->count * 2
+                * sizeof ( struct sort_entry_t ) ) ) )
+    {
+        secure_free_mem ( keys, keys_size );
+        return -1;
+    }
+
+    for ( ptr = *head, key = keys, i = 0; ptr; ptr = ptr->next, i++ )
+    {
+        for ( len = 0; ptr->name[len]; len++ )
         {
-            node->prev->next = node->next;
+            key[len] = tolower ( ( uint8_t ) ptr->name[len] );
         }
+        key[len] = '\0';
+        entries[i].key = key;
+        entries[i].item = ptr;
+        key += len + 1;
+    }
+
+    merge_sort_entries ( entries, entries + index->count, index->count );
+
+    for ( i = 0; i < index->count; i++ )
+    {
+        index->items[i] = entries[i].item;
     }
+
+    linked2_relink ( head, tail, index );
+
+    free ( entries );
+    secure_free_mem ( keys, keys_size );
+    return 0;
 }
 
-static void linked2_sort ( struct linked2_t **head, struct linked2_t **tail )
+static void linked2_sort ( struct linked2_t **head, struct linked2_t **tail,
+    struct sorted_index_t *index )
 {
     struct linked2_t *ptr;
-    struct linked2_t *prev;
-    struct linked2_t *new_head = NULL;
-    struct linked2_t *new_tail = NULL;
+    struct linked2_t *next;
+
+    if ( index->count < 2 || linked2_sort_keys ( head, tail, index ) >= 0 )
+    {
+        return;
+    }
+
+    ptr = *head;
+    *head = NULL;
+    *tail = NULL;
+    index->count = 0;
 
-    for ( ptr = *tail; ptr; ptr = prev )
+    /* Out of memory for keys, rebuild by insertion as the index has room */
+    for ( ; ptr; ptr = next )
     {
-        prev = ptr->prev;
-        linked2_unlink ( head, tail, ptr );
-        linked2_insert ( &new_head, &new_tail, ptr, NULL );
+        next = ptr->next;
+        linked2_insert ( head, tail, index, ptr, NULL );
     }
-
-    *head = new_head;
-    *tail = new_tail;
 }
 
-static void append_child_no_check ( struct holder_t *holder, struct node_t *node, int *position )
+static int append_child_no_check ( struct holder_t *holder, struct node_t *node, int *position )
 {
-    linked2_insert ( ( struct linked2_t ** ) &holder->children_head,
-        ( struct linked2_t ** ) &holder->children_tail, ( struct linked2_t * ) node, position );
+    if ( linked2_insert ( ( struct linked2_t ** ) &holder->children_head,
+            ( struct linked2_t ** ) &holder->children_tail, &holder->children,
+            ( struct linked2_t * ) node, position ) < 0 )
+    {
+        return -1;
+    }
+
+    node->parent = ( struct node_t * ) holder;
+    invalidate_signatures ( node->parent );
+    return 0;
 }
 
 int append_child_pos ( struct holder_t *holder, struct node_t *node, int *position )
@@ -825,8 +2291,7 @@ int append_child_pos ( struct holder_t *holder, struct node_t *node, int *positi
         errno = EEXIST;
         return -1;
     }
-    append_child_no_check ( holder, node, position );
-    return 0;
+    return append_child_no_check ( holder, node, position );
 }
 
 int append_child ( struct holder_t *holder, struct node_t *node )
@@ -837,19 +2302,30 @@ int append_child ( struct holder_t *holder, struct node_t *node )
 static void unlink_child ( struct holder_t *holder, struct node_t *node )
 {
     linked2_unlink ( ( struct linked2_t ** ) &holder->children_head,
-        ( struct linked2_t ** ) &holder->children_tail, ( struct linked2_t * ) node );
+        ( struct linked2_t ** ) &holder->children_tail, &holder->children,
+        ( struct linked2_t * ) node );
+    node->parent = NULL;
+    invalidate_signatures ( ( struct node_t * ) holder );
 }
 
 void delete_child ( struct holder_t *holder, struct node_t *node )
 {
     unlink_child ( holder, node );
-    free_node ( node );
+    free_tree ( node );
 }
 
-static void append_field_no_check ( struct leaf_t *leaf, struct field_t *field, int *position )
+static int append_field_no_check ( struct leaf_t *leaf, struct field_t *field, int *position )
 {
-    linked2_insert ( ( struct linked2_t ** ) &leaf->fields_head,
-        ( struct linked2_t ** ) &leaf->fields_tail, ( struct linked2_t * ) field, position );
+    if ( linked2_insert ( ( struct linked2_t ** ) &leaf->fields_head,
+            ( struct linked2_t ** ) &leaf->fields_tail, &leaf->fields,
+            ( struct linked2_t * ) field, position ) < 0 )
+    {
+        return -1;
+    }
+
+    field->leaf = leaf;
+    invalidate_signatures ( ( struct node_t * ) leaf );
+    return 0;
 }
 
 int append_field_pos ( struct leaf_t *leaf, struct field_t *field, int *position )
@@ -867,8 +2343,7 @@ int append_field_pos ( struct leaf_t *leaf, struct field_t *field, int *position
         return -1;
     }
 
-    append_field_no_check ( leaf, field, position );
-    return 0;
+    return append_field_no_check ( leaf, field, position );
 }
 
 int append_field ( struct leaf_t *leaf, struct field_t *field )
@@ -879,7 +2354,9 @@ int append_field ( struct leaf_t *leaf, struct field_t *field )
 static void unlink_field ( struct leaf_t *leaf, struct field_t *field )
 {
     linked2_unlink ( ( struct linked2_t ** ) &leaf->fields_head,
-        ( struct linked2_t ** ) &leaf->fields_tail, ( struct linked2_t * ) field );
+        ( struct linked2_t ** ) &leaf->fields_tail, &leaf->fields, ( struct linked2_t * ) field );
+    field->leaf = NULL;
+    invalidate_signatures ( ( struct node_t * ) leaf );
 }
 
 void delete_field ( struct leaf_t *leaf, struct field_t *field )
@@ -888,87 +2365,255 @@ void delete_field ( struct leaf_t *leaf, struct field_t *field )
     free_field ( field );
 }
 
-static void merge_fields ( struct leaf_t *a, struct leaf_t *b, struct database_stats_t *stats )
+/*
+ * Both sides are sorted the same way, so items are matched by walking them
+ * together. Unmatched items of b are moved over to a as one sorted batch.
+ */
+static int merge_fields ( struct leaf_t *a, struct leaf_t *b, struct database_stats_t *stats )
 {
-    int exists;
+    int cmp;
+    size_t i;
+    size_t j;
+    size_t n = 0;
+    void **batch;
     struct field_t *a_ptr;
     struct field_t *b_ptr;
-    struct field_t *b_next;
 
-    for ( b_ptr = b->fields_head; b_ptr; b_ptr = b_next )
+    if ( !b->fields.count )
+    {
+        return 0;
+    }
+
+    if ( !( batch = ( void ** ) malloc ( b->fields.count * sizeof ( void * ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0, j = 0; i < b->fields.count; i++ )
     {
-        b_next = b_ptr->next;
-        for ( a_ptr = a->fields_head, exists = FALSE; a_ptr; a_ptr = a_ptr->next )
+        b_ptr = ( struct field_t * ) b->fields.items[i];
+
+        for ( cmp = 1; j < a->fields.count; j++ )
         {
-            if ( !strcasecmp ( a_ptr->name, b_ptr->name ) )
+            a_ptr = ( struct field_t * ) a->fields.items[j];
+            if ( ( cmp = a_ptr->name_id == b_ptr->name_id ? 0
+                    : strcasecmp ( a_ptr->name, b_ptr->name ) ) >= 0 )
             {
-                if ( b_ptr->modified > a_ptr->modified )
-                {
-                    a_ptr->value = b_ptr->value;
-                    a_ptr->modified = b_ptr->modified;
-                    b_ptr->value = NULL;
-                    stats->fields_updated++;
-                }
-                exists = TRUE;
                 break;
             }
         }
 
-        if ( !exists )
+        if ( cmp )
+        {
+            batch[n++] = b_ptr;
+            continue;
+        }
+
+        if ( b_ptr->modified > a_ptr->modified )
+        {
+            secure_free_string ( a_ptr->value );
+            a_ptr->value = b_ptr->value;
+            a_ptr->modified = b_ptr->modified;
+            b_ptr->value = NULL;
+            stats->fields_updated++;
+        }
+    }
+
+    if ( n && linked2_insert_batch ( ( struct linked2_t ** ) &a->fields_head,
+            ( struct linked2_t ** ) &a->fields_tail, &a->fields, batch, n ) < 0 )
+    {
+        free ( batch );
+        return -1;
+    }
+
+    linked2_remove_batch ( ( struct linked2_t ** ) &b->fields_head,
+        ( struct linked2_t ** ) &b->fields_tail, &b->fields, batch, n );
+    stats->fields_added += n;
+
+    for ( i = 0; i < n; i++ )
+    {
+        ( ( struct field_t * ) batch[i] )->leaf = a;
+    }
+
+    free ( batch );
+    return 0;
+}
+
+struct merge_task_t
+{
+    struct node_t *a;
+    struct node_t *b;
+    struct database_stats_t stats;
+};
+
+static int merge_task ( void *ctx, size_t index )
+{
+    struct merge_task_t *task = ( struct merge_task_t * ) ctx + index;
+    return merge_node ( task->a, task->b, &task->stats, FALSE );
+}
+
+/*
+ * Matched pairs only touch their own subtrees, so they are merged as tasks
+ * with counters of their own. The first level with more than one pair fans
+ * out, deeper levels run serially on the worker that took the pair. New
+ * children are added to the parent by the calling thread afterwards.
+ */
+static int merge_pairs ( struct merge_task_t *tasks, size_t ntasks,
+    struct database_stats_t *stats, int parallel )
+{
+    size_t i;
+
+    if ( parallel && ntasks > 1 )
+    {
+        if ( parallel_run ( ntasks, merge_task, tasks ) < 0 )
+        {
+            return -1;
+        }
+    } else
+    {
+        for ( i = 0; i < ntasks; i++ )
         {
-            b_next = b_ptr->next;
-            unlink_field ( b, b_ptr );
-            append_field_no_check ( a, b_ptr, NULL );
-            stats->fields_added++;
+            if ( merge_node ( tasks[i].a, tasks[i].b, &tasks[i].stats, parallel ) < 0 )
+            {
+                return -1;
+            }
         }
     }
+
+    for ( i = 0; i < ntasks; i++ )
+    {
+        stats->holders_added += tasks[i].stats.holders_added;
+        stats->leaves_added += tasks[i].stats.leaves_added;
+        stats->fields_added += tasks[i].stats.fields_added;
+        stats->fields_updated += tasks[i].stats.fields_updated;
+    }
+
+    return 0;
 }
 
-static int merge_children ( struct holder_t *a, struct holder_t *b, struct database_stats_t *stats )
+static int merge_children ( struct holder_t *a, struct holder_t *b, struct database_stats_t *stats,
+    int parallel )
 {
-    int exists;
+    int cmp;
+    size_t i;
+    size_t j;
+    size_t n = 0;
+    size_t ntasks = 0;
+    void **batch;
+    struct merge_task_t *tasks;
     struct node_t *a_ptr;
     struct node_t *b_ptr;
-    struct node_t *b_next;
 
-    for ( b_ptr = b->children_head; b_ptr; b_ptr = b_next )
+    if ( !b->children.count )
+    {
+        return 0;
+    }
+
+    if ( !( batch = ( void ** ) malloc ( b->children.count * sizeof ( void * ) ) ) )
+    {
+        return -1;
+    }
+
+    if ( !( tasks = ( struct merge_task_t * ) calloc ( b->children.count,
+                sizeof ( struct merge_task_t ) ) ) )
+    {
+        free ( batch );
+        return -1;
+    }
+
+    for ( i = 0, j = 0; i < b->children.count; i++ )
     {
-        b_next = b_ptr->next;
-        for ( a_ptr = a->children_head, exists = FALSE; a_ptr; a_ptr = a_ptr->next )
+        b_ptr = ( struct node_t * ) b->children.items[i];
+
+        for ( cmp = 1; j < a->children.count; j++ )
         {
-            if ( !strcasecmp ( a_ptr->name, b_ptr->name ) )
+            a_ptr = ( struct node_t * ) a->children.items[j];
+            if ( ( cmp = strcasecmp ( a_ptr->name, b_ptr->name ) ) >= 0 )
             {
-                if ( merge_node ( a_ptr, b_ptr, stats ) < 0 )
-                {
-                    return -1;
-                }
-                exists = TRUE;
                 break;
             }
         }
 
-        if ( !exists )
+        if ( cmp )
         {
-            b_next = b_ptr->next;
-            unlink_child ( b, b_ptr );
-            append_child_no_check ( a, b_ptr, NULL );
-            if ( b_ptr->is_leaf )
-            {
-                stats->leaves_added++;
-            } else
-            {
-                stats->holders_added++;
-            }
+            batch[n++] = b_ptr;
+            continue;
+        }
+
+        tasks[ntasks].a = a_ptr;
+        tasks[ntasks].b = b_ptr;
+        ntasks++;
+    }
+
+    if ( merge_pairs ( tasks, ntasks, stats, parallel ) < 0 )
+    {
+        free ( tasks );
+        free ( batch );
+        return -1;
+    }
+
+    free ( tasks );
+
+    if ( n && linked2_insert_batch ( ( struct linked2_t ** ) &a->children_head,
+            ( struct linked2_t ** ) &a->children_tail, &a->children, batch, n ) < 0 )
+    {
+        free ( batch );
+        return -1;
+    }
+
+    linked2_remove_batch ( ( struct linked2_t ** ) &b->children_head,
+        ( struct linked2_t ** ) &b->children_tail, &b->children, batch, n );
+
+    for ( i = 0; i < n; i++ )
+    {
+        ( ( struct node_t * ) batch[i] )->parent = ( struct node_t * ) a;
+
+        if ( ( ( struct node_t * ) batch[i] )->is_leaf )
+        {
+            stats->leaves_added++;
+        } else
+        {
+            stats->holders_added++;
         }
     }
 
+    free ( batch );
     return 0;
 }
 
-static int merge_node ( struct node_t *a, struct node_t *b, struct database_stats_t *stats )
+/* Owners of the items swapped in follow their new container */
+static void adopt_items ( struct node_t *node )
+{
+    struct node_t *child;
+    struct field_t *field;
+
+    if ( node->is_leaf )
+    {
+        for ( field = ( ( struct leaf_t * ) node )->fields_head; field; field = field->next )
+        {
+            field->leaf = ( struct leaf_t * ) node;
+        }
+        return;
+    }
+
+    for ( child = ( ( struct holder_t * ) node )->children_head; child; child = child->next )
+    {
+        child->parent = node;
+    }
+}
+
+/*
+ * Every node of the tree that is visited is cleared, its ancestors were
+ * cleared before the merge started. Workers only write their own subtrees.
+ */
+static int merge_node ( struct node_t *a, struct node_t *b, struct database_stats_t *stats,
+    int parallel )
 {
     struct node_t *found;
     struct leaf_t tmp;
+
+    a->sig_valid = FALSE;
+
     if ( a->is_leaf && !b->is_leaf )
     {
         if ( sizeof ( struct leaf_t ) != sizeof ( struct holder_t ) )
@@ -979,6 +2624,16 @@ static int merge_node ( struct node_t *a, struct node_t *b, struct database_stat
         memcpy ( &tmp, a, sizeof ( struct leaf_t ) );
         memcpy ( a, b, sizeof ( struct leaf_t ) );
         memcpy ( b, &tmp, sizeof ( struct leaf_t ) );
+        /* Only the contents trade places, each node stays linked where it was */
+        b->prev = a->prev;
+        b->next = a->next;
+        b->parent = a->parent;
+        a->prev = ( struct node_t * ) tmp.prev;
+        a->next = ( struct node_t * ) tmp.next;
+        a->parent = tmp.parent;
+        a->sig_valid = FALSE;
+        adopt_items ( a );
+        adopt_items ( b );
     }
     if ( !a->is_leaf && b->is_leaf )
     {
@@ -992,25 +2647,28 @@ static int merge_node ( struct node_t *a, struct node_t *b, struct database_stat
             {
                 return -1;
             }
-            append_child_no_check ( ( struct holder_t * ) a, found, NULL );
+            if ( append_child_no_check ( ( struct holder_t * ) a, found, NULL ) < 0 )
+            {
+                free_tree ( found );
+                return -1;
+            }
         }
-        return merge_node ( found, b, stats );
+        return merge_node ( found, b, stats, parallel );
     }
 
     if ( a->is_leaf )
     {
-        merge_fields ( ( struct leaf_t * ) a, ( struct leaf_t * ) b, stats );
-    } else
-    {
-        return merge_children ( ( struct holder_t * ) a, ( struct holder_t * ) b, stats );
+        return merge_fields ( ( struct leaf_t * ) a, ( struct leaf_t * ) b, stats );
     }
-    return 0;
+
+    return merge_children ( ( struct holder_t * ) a, ( struct holder_t * ) b, stats, parallel );
 }
 
 int merge_tree ( struct node_t *tree, struct node_t *aux, struct database_stats_t *stats )
 {
     int ret;
-    ret = merge_node ( tree, aux, stats );
+    invalidate_signatures ( tree );
+    ret = merge_node ( tree, aux, stats, TRUE );
     free_tree ( aux );
     return ret;
 }
@@ -1018,9 +2676,7 @@ int merge_tree ( struct node_t *tree, struct node_t *aux, struct database_stats_
 static struct node_t *find_node_by_path_in ( struct node_t *branch, int *indices, int depth,
     struct node_t **prev_parent, struct node_t **parent )
 {
-    int position;
     struct node_t *ptr;
-    struct holder_t *holder;
 
     *prev_parent = *parent;
     *parent = branch;
@@ -1030,18 +2686,12 @@ static struct node_t *find_node_by_path_in ( struct node_t *branch, int *indices
         return branch;
     }
 
-    holder = ( struct holder_t * ) branch;
-    position = 0;
-    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    if ( !( ptr = get_nth_node ( ( struct holder_t * ) branch, indices[0] ) ) )
     {
-        if ( position == indices[0] )
-        {
-            return find_node_by_path_in ( ptr, indices + 1, depth - 1, prev_parent, parent );
-        }
-        position++;
+        return NULL;
     }
 
-    return NULL;
+    return find_node_by_path_in ( ptr, indices + 1, depth - 1, prev_parent, parent );
 }
 
 struct node_t *find_node_by_path ( struct node_t *branch, int *indices, int depth,
@@ -1059,32 +2709,20 @@ struct node_t *find_node_by_path ( struct node_t *branch, int *indices, int dept
 
 struct node_t *get_nth_node ( struct holder_t *holder, int index )
 {
-    struct node_t *ptr;
-    int position = 0;
-    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    if ( index < 0 || ( size_t ) index >= holder->children.count )
     {
-        if ( position == index )
-        {
-            return ptr;
-        }
-        position++;
+        return NULL;
     }
-    return NULL;
+    return ( struct node_t * ) holder->children.items[index];
 }
 
 struct field_t *get_nth_field ( struct leaf_t *leaf, int index )
 {
-    struct field_t *ptr;
-    int position = 0;
-    for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
+    if ( index < 0 || ( size_t ) index >= leaf->fields.count )
     {
-        if ( position == index )
-        {
-            return ptr;
-        }
-        position++;
+        return NULL;
     }
-    return NULL;
+    return ( struct field_t * ) leaf->fields.items[index];
 }
 
 char *copy_as_tsv ( const struct leaf_t *leaf )
@@ -1223,126 +2861,248 @@ int randbyte ( int fd )
     return byte;
 }
 
-char oneof ( const char *array, int fd )
+char oneof ( const char *array, int fd )
+{
+    return array[randbyte ( fd ) % strlen ( array )];
+}
+
+#define PASSWORD_UPPER "QWERTYUIOPASDFGHJKLZXCVBNM"
+#define PASSWORD_LOWER "qwertyuiopasdfghjklzxcvbnm"
+#define PASSWORD_NUMBER "0123456789"
+#define PASSWORD_SPECIAL "~!@#$%^&*()_+-={}[];:,./<>?"
+
+int generate_password ( char *result, size_t size )
+{
+    char backup;
+    int fd;
+    size_t i;
+    size_t j;
+    size_t length;
+    const char *upper = PASSWORD_UPPER;
+    const char *lower = PASSWORD_LOWER;
+    const char *number = PASSWORD_NUMBER;
+    const char *special = PASSWORD_SPECIAL;
+    const char *all = PASSWORD_UPPER PASSWORD_LOWER PASSWORD_NUMBER PASSWORD_SPECIAL;
+
+    if ( ( fd = open ( "/dev/urandom", O_RDONLY ) ) < 0 )
+    {
+        return -1;
+    }
+
+    length = randbyte ( fd ) % 18;
+    if ( length < 10 )
+    {
+        length = 10;
+    }
+
+    if ( length >= size )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    result[0] = oneof ( upper, fd );
+    result[1] = oneof ( lower, fd );
+    result[2] = oneof ( number, fd );
+    result[3] = oneof ( special, fd );
+
+    for ( i = 4; i < length; i++ )
+    {
+        result[i] = oneof ( all, fd );
+    }
+
+    for ( i = 0; i + 1 < length; i++ )
+    {
+        j = randbyte ( fd ) * ( length - i ) / 256 + i;
+        backup = result[j];
+        result[j] = result[i];
+        result[i] = backup;
+    }
+
+    result[length] = '\0';
+    close ( fd );
+    return 0;
+}
+
+/*
+ * Fuzzy results are ranked by score, names weighing more than values, and
+ * only the best SEARCH_TOP_MAX are kept. Until the walk ends they form a
+ * heap with the weakest result on top, ties going to the later one, so a
+ * result is only built when it beats that one.
+ */
+static int search_result_weaker ( const struct search_result_t *a,
+    const struct search_result_t *b )
+{
+    return a->score < b->score || ( a->score == b->score && a->order > b->order );
+}
+
+static void search_heap_up ( struct search_result_t *heap, size_t i )
+{
+    struct search_result_t tmp;
+
+    for ( ; i && search_result_weaker ( heap + i, heap + ( i - 1 ) / 2 ); i = ( i - 1 ) / 2 )
+    {
+        tmp = heap[i];
+        heap[i] = heap[( i - 1 ) / 2];
+        heap[( i - 1 ) / 2] = tmp;
+    }
+}
+
+static void search_heap_down ( struct search_result_t *heap, size_t i, size_t n )
+{
+    size_t child;
+    struct search_result_t tmp;
+
+    for ( ; ( child = i * 2 + 1 ) < n; i = child )
+    {
+        if ( child + 1 < n && search_result_weaker ( heap + child + 1, heap + child ) )
+        {
+            child++;
+        }
+
+        if ( !search_result_weaker ( heap + child, heap + i ) )
+        {
+            break;
+        }
+
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+    }
+}
+
+static void free_search_result ( struct search_result_t *result )
+{
+    secure_free_string ( result->name );
+    secure_free_mem ( result->indices, result->depth * sizeof ( int ) );
+}
+
+/* Substring matches score one, so that a result either counts or does not */
+static int search_score ( const struct search_ctx_t *ctx, const char *text, int weight )
+{
+    if ( ~ctx->options & SEARCH_FUZZY )
+    {
+        return match_test ( &ctx->match, text );
+    }
+
+    return match_score ( &ctx->match, text ) * weight;
+}
+
+static int search_field_score ( const struct search_ctx_t *ctx, const struct field_t *field )
+{
+    int score = 0;
+    int value_score = 0;
+
+    if ( ctx->options & SEARCH_FIELD_NAME )
+    {
+        score = search_score ( ctx, field->name, SEARCH_NAME_WEIGHT );
+    }
+
+    if ( ( ctx->options & SEARCH_FIELD_VALUE ) && ( !score || ( ctx->options & SEARCH_FUZZY ) ) )
+    {
+        value_score = search_score ( ctx, field->value, 1 );
+    }
+
+    return score > value_score ? score : value_score;
+}
+
+static int search_keeps_score ( const struct search_ctx_t *ctx, int score )
 {
-    return array[randbyte ( fd ) % strlen ( array )];
+    return ( ~ctx->options & SEARCH_FUZZY )
+        || ctx->results.len < SEARCH_TOP_MAX * sizeof ( struct search_result_t )
+        || score > ( ( const struct search_result_t * ) ctx->results.mem )->score;
 }
 
-#define PASSWORD_UPPER "QWERTYUIOPASDFGHJKLZXCVBNM"
-#define PASSWORD_LOWER "qwertyuiopasdfghjklzxcvbnm"
-#define PASSWORD_NUMBER "0123456789"
-#define PASSWORD_SPECIAL "~!@#$%^&*()_+-={}[];:,./<>?"
-
-int generate_password ( char *result, size_t size )
+static int search_add_result ( struct search_ctx_t *ctx, int score, const char *value,
+    const char *match_name )
 {
-    char backup;
-    int fd;
-    size_t i;
-    size_t j;
-    size_t length;
-    const char *upper = PASSWORD_UPPER;
-    const char *lower = PASSWORD_LOWER;
-    const char *number = PASSWORD_NUMBER;
-    const char *special = PASSWORD_SPECIAL;
-    const char *all = PASSWORD_UPPER PASSWORD_LOWER PASSWORD_NUMBER PASSWORD_SPECIAL;
+    struct search_result_t result;
+    struct search_result_t *heap;
+    struct stack_t indices = { 0 };
 
-    if ( ( fd = open ( "/dev/urandom", O_RDONLY ) ) < 0 )
+    if ( stack_clone ( &ctx->indices, &indices ) < 0 )
     {
         return -1;
     }
 
-    length = randbyte ( fd ) % 18;
-    if ( length < 10 )
+    if ( !( result.name = new_string ( ( char * ) ctx->name.mem ) ) )
     {
-        length = 10;
+        free_stack ( &indices );
+        return -1;
     }
 
-    if ( length >= size )
+    result.indices = ( int * ) indices.mem;
+    result.depth = indices.len / sizeof ( int );
+    result.value = value;
+    result.match_name = match_name;
+    result.score = score;
+    result.order = ctx->order++;
+
+    if ( ( ctx->options & SEARCH_FUZZY )
+        && ctx->results.len >= SEARCH_TOP_MAX * sizeof ( struct search_result_t ) )
     {
-        close ( fd );
-        return -1;
+        heap = ( struct search_result_t * ) ctx->results.mem;
+        free_search_result ( heap );
+        heap[0] = result;
+        search_heap_down ( heap, 0, SEARCH_TOP_MAX );
+        return 0;
     }
 
-    result[0] = oneof ( upper, fd );
-    result[1] = oneof ( lower, fd );
-    result[2] = oneof ( number, fd );
-    result[3] = oneof ( special, fd );
-
-    for ( i = 4; i < length; i++ )
+    if ( push_binary ( &ctx->results, ( uint8_t * ) & result, sizeof ( result ) ) < 0 )
     {
-        result[i] = oneof ( all, fd );
+        free_search_result ( &result );
+        return -1;
     }
 
-    for ( i = 0; i + 1 < length; i++ )
+    if ( ctx->options & SEARCH_FUZZY )
     {
-        j = randbyte ( fd ) * ( length - i ) / 256 + i;
-        backup = result[j];
-        result[j] = result[i];
-        result[i] = backup;
+        search_heap_up ( ( struct search_result_t * ) ctx->results.mem,
+            ctx->results.len / sizeof ( struct search_result_t ) - 1 );
     }
 
-    result[length] = '\0';
-    close ( fd );
     return 0;
 }
 
-static int search_includes ( int options, const char *haystack, const char *needle )
+/* Tasks may bring more than the limit together, the weakest are dropped first */
+static void search_rank ( struct stack_t *results )
 {
-    int found = FALSE;
     size_t i;
-    size_t j;
-    size_t i_off;
-    size_t j_off;
-    size_t haystack_len;
-    size_t needle_len;
+    size_t n;
+    struct search_result_t tmp;
+    struct search_result_t *heap;
+
+    heap = ( struct search_result_t * ) results->mem;
+    n = results->len / sizeof ( struct search_result_t );
 
-    if ( ~options & SEARCH_IGNORE_WHITESPACES )
+    for ( i = n / 2; i > 0; i-- )
     {
-        return !!strcasestr ( haystack, needle );
+        search_heap_down ( heap, i - 1, n );
     }
 
-    haystack_len = strlen ( haystack );
-    needle_len = strlen ( needle );
-
-    for ( i = 0; i < haystack_len; i++ )
+    for ( ; n > SEARCH_TOP_MAX; n-- )
     {
-        found = TRUE;
-        j = 0;
-        i_off = 0;
-        j_off = 0;
-        while ( j + j_off < needle_len && i + i_off < haystack_len )
-        {
-            if ( isblank ( needle[j + j_off] ) )
-            {
-                j_off++;
-            } else if ( isblank ( haystack[i + i_off + j] ) )
-            {
-                i_off++;
-            } else if ( tolower ( haystack[i + i_off + j] ) == tolower ( needle[j + j_off] ) )
-            {
-                j++;
-            } else
-            {
-                found = FALSE;
-                break;
-            }
-        }
-
-        if ( found )
-        {
-            break;
-        }
+        free_search_result ( heap );
+        heap[0] = heap[n - 1];
+        memset ( heap + n - 1, '\0', sizeof ( struct search_result_t ) );
+        search_heap_down ( heap, 0, n - 1 );
     }
 
-    return found;
+    results->len = n * sizeof ( struct search_result_t );
+
+    for ( i = n; i > 1; i-- )
+    {
+        tmp = heap[0];
+        heap[0] = heap[i - 1];
+        heap[i - 1] = tmp;
+        search_heap_down ( heap, 0, i - 1 );
+    }
 }
 
 int search_fields ( struct leaf_t *leaf, struct search_ctx_t *ctx )
 {
+    int score;
     size_t namelen;
     struct field_t *ptr;
-    struct search_result_t result;
-    struct stack_t current_indices = { 0 };
 
     if ( ctx->name.len )
     {
@@ -1353,10 +3113,7 @@ int search_fields ( struct leaf_t *leaf, struct search_ctx_t *ctx )
 
     for ( ptr = leaf->fields_head; ptr; ptr = ptr->next )
     {
-        if ( ( ( ctx->options & SEARCH_FIELD_NAME )
-                && search_includes ( ctx->options, ptr->name, ctx->phrase ) )
-            || ( ( ctx->options & SEARCH_FIELD_VALUE )
-                && search_includes ( ctx->options, ptr->value, ctx->phrase ) ) )
+        if ( ( score = search_field_score ( ctx, ptr ) ) && search_keeps_score ( ctx, score ) )
         {
 
             if ( push_string ( &ctx->name, " > " ) < 0
@@ -1365,18 +3122,8 @@ int search_fields ( struct leaf_t *leaf, struct search_ctx_t *ctx )
                 return -1;
             }
 
-            if ( stack_clone ( &ctx->indices, &current_indices ) < 0 )
-            {
-                return -1;
-            }
-            result.indices = ( int * ) current_indices.mem;
-            result.depth = current_indices.len / sizeof ( int );
-            result.name = new_string ( ( char * ) ctx->name.mem );
-            result.value = ptr->value;
-            if ( push_binary ( &ctx->results, ( uint8_t * ) & result, sizeof ( result ) ) < 0 )
+            if ( search_add_result ( ctx, score, ptr->value, ptr->name ) < 0 )
             {
-                secure_free_string ( result.name );
-                free_stack ( &current_indices );
                 return -1;
             }
 
@@ -1436,12 +3183,108 @@ int search_children ( struct holder_t *holder, struct search_ctx_t *ctx )
     return 0;
 }
 
+struct search_task_t
+{
+    struct node_t *node;
+    struct search_ctx_t ctx;
+};
+
+static int search_task ( void *ctx, size_t index )
+{
+    struct search_task_t *task = ( struct search_task_t * ) ctx + index;
+    return search_generic ( task->node, &task->ctx );
+}
+
+static void free_search_task ( struct search_task_t *task )
+{
+    size_t n;
+
+    n = task->ctx.results.len / sizeof ( struct search_result_t );
+    search_free ( ( struct search_result_t ** ) &task->ctx.results.mem, &n );
+    free_stack ( &task->ctx.name );
+    free_stack ( &task->ctx.namelens );
+    free_stack ( &task->ctx.indices );
+}
+
+/*
+ * Children of the searched node are walked as tasks, each one with a context
+ * of its own that starts at the path and index the serial walk would have.
+ * The phrase and signature are only read and shared. Results are appended in
+ * child order afterwards, so they come out the same as with one thread.
+ */
+static int search_subtrees ( struct holder_t *holder, struct search_ctx_t *ctx )
+{
+    int ret = 0;
+    int position;
+    size_t i;
+    size_t j;
+    struct search_task_t *tasks;
+    struct search_result_t *found;
+
+    if ( !( tasks = ( struct search_task_t * ) calloc ( holder->children.count,
+                sizeof ( struct search_task_t ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < holder->children.count && ret >= 0; i++ )
+    {
+        position = i;
+        tasks[i].node = ( struct node_t * ) holder->children.items[i];
+        tasks[i].ctx.options = ctx->options;
+        tasks[i].ctx.match = ctx->match;
+        memcpy ( tasks[i].ctx.sig, ctx->sig, sizeof ( ctx->sig ) );
+
+        if ( push_binary ( &tasks[i].ctx.indices, ( uint8_t * ) & position,
+                sizeof ( position ) ) < 0
+            || push_binary ( &tasks[i].ctx.name, ctx->name.mem, ctx->name.len ) < 0 )
+        {
+            ret = -1;
+        }
+    }
+
+    if ( ret >= 0 )
+    {
+        ret = parallel_run ( holder->children.count, search_task, tasks );
+    }
+
+    for ( i = 0; i < holder->children.count; i++ )
+    {
+        found = ( struct search_result_t * ) tasks[i].ctx.results.mem;
+
+        /* Orders count on from the tasks before, ties rank in tree order still */
+        for ( j = 0; j < tasks[i].ctx.results.len / sizeof ( struct search_result_t ); j++ )
+        {
+            found[j].order += ctx->order;
+        }
+
+        ctx->order += tasks[i].ctx.order;
+
+        if ( ret >= 0 && tasks[i].ctx.results.len
+            && ( ret = push_binary ( &ctx->results, tasks[i].ctx.results.mem,
+                    tasks[i].ctx.results.len ) ) >= 0 )
+        {
+            free_stack ( &tasks[i].ctx.results );
+        }
+
+        free_search_task ( &tasks[i] );
+    }
+
+    free ( tasks );
+    return ret;
+}
+
 static int search_generic ( struct node_t *node, struct search_ctx_t *ctx )
 {
     int ret = 0;
+    int score;
     int first = TRUE;
-    struct search_result_t result;
-    struct stack_t current_indices = { 0 };
+
+    /* Nothing below can match when the phrase has trigrams the subtree lacks */
+    if ( !sig_contains ( node_signature ( node ), ctx->sig ) )
+    {
+        return 0;
+    }
 
     if ( ctx->name.len )
     {
@@ -1472,19 +3315,11 @@ static int search_generic ( struct node_t *node, struct search_ctx_t *ctx )
 
     if ( ( ( ( ctx->options & SEARCH_LEAF_NAME ) && node->is_leaf )
             || ( ( ctx->options & SEARCH_HOLDER_NAME ) && !node->is_leaf ) )
-        && !first && search_includes ( ctx->options, node->name, ctx->phrase ) )
+        && !first && ( score = search_score ( ctx, node->name, SEARCH_NAME_WEIGHT ) )
+        && search_keeps_score ( ctx, score ) )
     {
-        if ( stack_clone ( &ctx->indices, &current_indices ) < 0 )
-        {
-            return -1;
-        }
-        result.indices = ( int * ) current_indices.mem;
-        result.depth = current_indices.len / sizeof ( int );
-        result.name = new_string ( ( char * ) ctx->name.mem );
-        result.value = NULL;
-        if ( push_binary ( &ctx->results, ( uint8_t * ) & result, sizeof ( result ) ) < 0 )
+        if ( search_add_result ( ctx, score, NULL, node->name ) < 0 )
         {
-            free_stack ( &current_indices );
             return -1;
         }
     }
@@ -1495,6 +3330,9 @@ static int search_generic ( struct node_t *node, struct search_ctx_t *ctx )
         {
             ret = search_fields ( ( struct leaf_t * ) node, ctx );
         }
+    } else if ( first && ( ( struct holder_t * ) node )->children.count > 1 )
+    {
+        ret = search_subtrees ( ( struct holder_t * ) node, ctx );
     } else
     {
         ret = search_children ( ( struct holder_t * ) node, ctx );
@@ -1522,14 +3360,31 @@ int search_run ( struct node_t *tree, int options, const char *phrase,
         return 0;
     }
 
+    if ( match_init ( &ctx.match, phrase,
+            options & ( SEARCH_IGNORE_WHITESPACES | SEARCH_FUZZY ) ) < 0 )
+    {
+        return -1;
+    }
+
     ctx.options = options;
-    ctx.phrase = phrase;
+
+    /* Fuzzy matches need not hold every trigram of the phrase */
+    if ( ~options & SEARCH_FUZZY )
+    {
+        sig_add_text ( ctx.sig, phrase );
+    }
 
     if ( ( ret = search_generic ( tree, &ctx ) ) >= 0 )
     {
+        if ( options & SEARCH_FUZZY )
+        {
+            search_rank ( &ctx.results );
+        }
+
         *results = ( struct search_result_t * ) ctx.results.mem;
     }
 
+    match_free ( &ctx.match );
     free_stack ( &ctx.name );
     free_stack ( &ctx.namelens );
     free_stack ( &ctx.indices );
@@ -1544,6 +3399,71 @@ int search_run ( struct node_t *tree, int options, const char *phrase,
     return ret;
 }
 
+static int search_result_matches ( const struct match_t *match, int options,
+    const struct search_result_t *result )
+{
+    if ( !result->value )
+    {
+        return match_test ( match, result->match_name );
+    }
+
+    return ( ( options & SEARCH_FIELD_NAME ) && match_test ( match, result->match_name ) )
+        || ( ( options & SEARCH_FIELD_VALUE ) && match_test ( match, result->value ) );
+}
+
+/*
+ * A phrase that extends the one the results were found with can only match
+ * some of them, so they are tested again in place instead of walking the
+ * tree. The tree must not have changed since the generation the results
+ * were found at, and the options must be the same. Results keep their order, as a full search would give them. Fuzzy
+ * results are not refined, a longer phrase may tolerate more typos.
+ */
+int search_refine ( int options, const char *phrase, unsigned int generation,
+    struct search_result_t *results, size_t *n )
+{
+    size_t i;
+    size_t kept = 0;
+    struct match_t match;
+
+    if ( generation != get_tree_generation (  ) )
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    if ( options & SEARCH_FUZZY )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !*n )
+    {
+        return 0;
+    }
+
+    if ( match_init ( &match, phrase, options & SEARCH_IGNORE_WHITESPACES ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < *n; i++ )
+    {
+        if ( search_result_matches ( &match, options, results + i ) )
+        {
+            results[kept++] = results[i];
+        } else
+        {
+            free_search_result ( results + i );
+        }
+    }
+
+    memset ( results + kept, '\0', ( *n - kept ) * sizeof ( struct search_result_t ) );
+    *n = kept;
+    match_free ( &match );
+    return 0;
+}
+
 void search_free ( struct search_result_t **results, size_t *n )
 {
     size_t i;
@@ -1590,12 +3510,20 @@ int rename_node ( struct holder_t *holder, struct node_t *node, const char *name
         return -1;
     }
 
+    invalidate_signatures ( node );
+
+    /* Unlinked under the old name, which is what the index is sorted by */
+    if ( holder )
+    {
+        unlink_child ( holder, node );
+    }
+
     secure_free_string ( node->name );
     node->name = name_alloc;
+
     if ( holder )
     {
-        unlink_child ( holder, node );
-        append_child_no_check ( holder, node, position );
+        return append_child_no_check ( holder, node, position );
     }
 
     return 0;
@@ -1603,6 +3531,7 @@ int rename_node ( struct holder_t *holder, struct node_t *node, const char *name
 
 int rename_field ( struct leaf_t *leaf, struct field_t *field, const char *name, int *position )
 {
+    int id;
     char *name_alloc;
     struct field_t *found;
 
@@ -1617,36 +3546,38 @@ int rename_field ( struct leaf_t *leaf, struct field_t *field, const char *name,
         return -1;
     }
 
-    if ( !( name_alloc = ( char * ) new_string_trimmed ( name ) ) )
+    if ( !( name_alloc = new_name_trimmed ( name, &id ) ) )
     {
         return -1;
     }
 
-    secure_free_string ( field->name );
-    field->name = name_alloc;
     unlink_field ( leaf, field );
-    append_field_no_check ( leaf, field, position );
-    return 0;
+    release_name ( field->name );
+    field->name = name_alloc;
+    field->name_id = id;
+    return append_field_no_check ( leaf, field, position );
 }
 
 static void sort_leaf_fields ( struct leaf_t *leaf )
 {
     linked2_sort ( ( struct linked2_t ** ) &leaf->fields_head,
-        ( struct linked2_t ** ) &leaf->fields_tail );
+        ( struct linked2_t ** ) &leaf->fields_tail, &leaf->fields );
 }
 
+static void sort_node ( struct node_t *node );
+
 static void sort_holder_children ( struct holder_t *holder )
 {
     struct node_t *ptr;
     linked2_sort ( ( struct linked2_t ** ) &holder->children_head,
-        ( struct linked2_t ** ) &holder->children_tail );
+        ( struct linked2_t ** ) &holder->children_tail, &holder->children );
     for ( ptr = holder->children_head; ptr; ptr = ptr->next )
     {
-        sort_tree ( ptr );
+        sort_node ( ptr );
     }
 }
 
-void sort_tree ( struct node_t *node )
+static void sort_node ( struct node_t *node )
 {
     if ( node->is_leaf )
     {
@@ -1656,3 +3587,136 @@ void sort_tree ( struct node_t *node )
         sort_holder_children ( ( struct holder_t * ) node );
     }
 }
+
+/* A run of siblings, sorted as one task */
+struct sort_task_t
+{
+    struct node_t *first;
+    size_t count;
+    size_t weight;
+};
+
+static int sort_subtree_task ( void *ctx, size_t index )
+{
+    size_t i;
+    struct node_t *ptr;
+    struct sort_task_t *task = ( struct sort_task_t * ) ctx + index;
+
+    for ( i = 0, ptr = task->first; i < task->count; i++, ptr = ptr->next )
+    {
+        sort_node ( ptr );
+    }
+
+    return 0;
+}
+
+static int compare_sort_tasks ( const void *a, const void *b )
+{
+    size_t wa = ( ( const struct sort_task_t * ) a )->weight;
+    size_t wb = ( ( const struct sort_task_t * ) b )->weight;
+
+    return wa < wb ? 1 : wa > wb ? -1 : 0;
+}
+
+/* Nodes and fields below node, counting stops once past the limit */
+static size_t weigh_subtree ( struct node_t *node, size_t limit )
+{
+    size_t weight = 1;
+    struct node_t *ptr;
+
+    if ( node->is_leaf )
+    {
+        return weight + ( ( struct leaf_t * ) node )->fields.count;
+    }
+
+    for ( ptr = ( ( struct holder_t * ) node )->children_head; ptr && weight <= limit;
+        ptr = ptr->next )
+    {
+        weight += weigh_subtree ( ptr, limit - weight );
+    }
+
+    return weight;
+}
+
+static int push_sort_task ( struct stack_t *tasks, struct sort_task_t *task )
+{
+    if ( task->count && push_binary ( tasks, ( const uint8_t * ) task, sizeof ( *task ) ) < 0 )
+    {
+        return -1;
+    }
+
+    task->count = 0;
+    task->weight = 0;
+    return 0;
+}
+
+/*
+ * Holders heavier than a task are split: their own list is sorted here and
+ * their children visited in turn. Lighter siblings are grouped into runs of
+ * up to a task's weight, so the tasks come out of comparable size whatever
+ * the shape of the tree.
+ */
+static int collect_sort_tasks ( struct holder_t *holder, struct stack_t *tasks )
+{
+    size_t weight;
+    struct node_t *ptr;
+    struct sort_task_t task = { NULL, 0, 0 };
+
+    linked2_sort ( ( struct linked2_t ** ) &holder->children_head,
+        ( struct linked2_t ** ) &holder->children_tail, &holder->children );
+
+    for ( ptr = holder->children_head; ptr; ptr = ptr->next )
+    {
+        weight = weigh_subtree ( ptr, SORT_TASK_WEIGHT );
+
+        if ( weight > SORT_TASK_WEIGHT && !ptr->is_leaf )
+        {
+            if ( push_sort_task ( tasks, &task ) < 0
+                || collect_sort_tasks ( ( struct holder_t * ) ptr, tasks ) < 0 )
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        if ( task.weight + weight > SORT_TASK_WEIGHT && push_sort_task ( tasks, &task ) < 0 )
+        {
+            return -1;
+        }
+
+        if ( !task.count )
+        {
+            task.first = ptr;
+        }
+
+        task.count++;
+        task.weight += weight;
+    }
+
+    return push_sort_task ( tasks, &task );
+}
+
+void sort_tree ( struct node_t *node )
+{
+    struct stack_t tasks = { 0 };
+
+    /* Spawning workers costs more than sorting a small tree */
+    if ( node->is_leaf || weigh_subtree ( node, SORT_PARALLEL_MIN ) <= SORT_PARALLEL_MIN )
+    {
+        sort_node ( node );
+        return;
+    }
+
+    if ( collect_sort_tasks ( ( struct holder_t * ) node, &tasks ) < 0 )
+    {
+        free_stack ( &tasks );
+        sort_node ( node );
+        return;
+    }
+
+    /* Heaviest tasks are handed out first, the light ones fill in at the end */
+    qsort ( tasks.mem, tasks.len / sizeof ( struct sort_task_t ), sizeof ( struct sort_task_t ),
+        compare_sort_tasks );
+    parallel_run ( tasks.len / sizeof ( struct sort_task_t ), sort_subtree_task, tasks.mem );
+    free_stack ( &tasks );
+}
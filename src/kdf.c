@@ -0,0 +1,373 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Key Derivation
+ * ------------------------------------------------------------------ */
+
+#include "kdf.h"
+#include "util.h"
+#include <mbedtls/md.h>
+#include <mbedtls/pkcs5.h>
+
+#define PBKDF2_MIN_ROUNDS 10000
+#define PBKDF2_MAX_ROUNDS 10000000
+#define PBKDF2_PROBE_ROUNDS 10000
+#define SCRYPT_MIN_LOG2_N 12
+#define SCRYPT_MAX_LOG2_N 22
+#define SCRYPT_MAX_R 32
+#define SCRYPT_MAX_P 16
+#define SCRYPT_MAX_MEMORY (1 << 28)
+#define SCRYPT_DEFAULT_R 8
+#define SCRYPT_DEFAULT_P 1
+
+void kdf_default_params ( struct kdf_params_t *params )
+{
+    memset ( params, '\0', sizeof ( struct kdf_params_t ) );
+    params->id = KDF_PBKDF2_SHA256;
+    params->rounds = KDF_DEFAULT_ROUNDS;
+}
+
+/*
+ * The cost is read from the header before anything is authenticated, so it
+ * is bounded to a few seconds and a few hundred megabytes, scrypt lanes
+ * counted together. Calibration is held to the same bounds, so every file
+ * this program writes stays readable.
+ */
+int kdf_params_valid ( const struct kdf_params_t *params )
+{
+    switch ( params->id )
+    {
+    case KDF_PBKDF2_SHA256:
+        return params->rounds && params->rounds <= PBKDF2_MAX_ROUNDS;
+    case KDF_SCRYPT:
+        return params->log2_n >= 1 && params->log2_n <= SCRYPT_MAX_LOG2_N
+            && params->r >= 1 && params->r <= SCRYPT_MAX_R
+            && params->p >= 1 && params->p <= SCRYPT_MAX_P
+            && ( ( ( size_t ) 128 * params->r * params->p ) << params->log2_n )
+            <= SCRYPT_MAX_MEMORY;
+    }
+
+    return FALSE;
+}
+
+int kdf_params_equal ( const struct kdf_params_t *a, const struct kdf_params_t *b )
+{
+    if ( a->id != b->id )
+    {
+        return FALSE;
+    }
+
+    if ( a->id == KDF_PBKDF2_SHA256 )
+    {
+        return a->rounds == b->rounds;
+    }
+
+    return a->log2_n == b->log2_n && a->r == b->r && a->p == b->p;
+}
+
+static int pbkdf2_sha256 ( const uint8_t * password, size_t password_len, const uint8_t * salt,
+    size_t salt_len, unsigned int rounds, uint8_t * key, size_t key_size )
+{
+    mbedtls_md_context_t sha256_ctx;
+    const mbedtls_md_info_t *sha256_info;
+
+    mbedtls_md_init ( &sha256_ctx );
+
+    if ( !( sha256_info = mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ) ) )
+    {
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    if ( mbedtls_md_setup ( &sha256_ctx, sha256_info, TRUE ) != 0 )
+    {
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    if ( mbedtls_pkcs5_pbkdf2_hmac ( &sha256_ctx, password, password_len, salt, salt_len,
+            rounds, key_size, key ) != 0 )
+    {
+        memset ( key, '\0', key_size );
+        mbedtls_md_free ( &sha256_ctx );
+        return -1;
+    }
+
+    mbedtls_md_free ( &sha256_ctx );
+    return 0;
+}
+
+static uint32_t rotl32 ( uint32_t value, int bits )
+{
+    return ( value << bits ) | ( value >> ( 32 - bits ) );
+}
+
+static void salsa20_8 ( uint32_t * block )
+{
+    int i;
+    uint32_t x[16];
+
+    memcpy ( x, block, sizeof ( x ) );
+
+    for ( i = 0; i < 8; i += 2 )
+    {
+        x[4] ^= rotl32 ( x[0] + x[12], 7 );
+        x[8] ^= rotl32 ( x[4] + x[0], 9 );
+        x[12] ^= rotl32 ( x[8] + x[4], 13 );
+        x[0] ^= rotl32 ( x[12] + x[8], 18 );
+        x[9] ^= rotl32 ( x[5] + x[1], 7 );
+        x[13] ^= rotl32 ( x[9] + x[5], 9 );
+        x[1] ^= rotl32 ( x[13] + x[9], 13 );
+        x[5] ^= rotl32 ( x[1] + x[13], 18 );
+        x[14] ^= rotl32 ( x[10] + x[6], 7 );
+        x[2] ^= rotl32 ( x[14] + x[10], 9 );
+        x[6] ^= rotl32 ( x[2] + x[14], 13 );
+        x[10] ^= rotl32 ( x[6] + x[2], 18 );
+        x[3] ^= rotl32 ( x[15] + x[11], 7 );
+        x[7] ^= rotl32 ( x[3] + x[15], 9 );
+        x[11] ^= rotl32 ( x[7] + x[3], 13 );
+        x[15] ^= rotl32 ( x[11] + x[7], 18 );
+        x[1] ^= rotl32 ( x[0] + x[3], 7 );
+        x[2] ^= rotl32 ( x[1] + x[0], 9 );
+        x[3] ^= rotl32 ( x[2] + x[1], 13 );
+        x[0] ^= rotl32 ( x[3] + x[2], 18 );
+        x[6] ^= rotl32 ( x[5] + x[4], 7 );
+        x[7] ^= rotl32 ( x[6] + x[5], 9 );
+        x[4] ^= rotl32 ( x[7] + x[6], 13 );
+        x[5] ^= rotl32 ( x[4] + x[7], 18 );
+        x[11] ^= rotl32 ( x[10] + x[9], 7 );
+        x[8] ^= rotl32 ( x[11] + x[10], 9 );
+        x[9] ^= rotl32 ( x[8] + x[11], 13 );
+        x[10] ^= rotl32 ( x[9] + x[8], 18 );
+        x[12] ^= rotl32 ( x[15] + x[14], 7 );
+        x[13] ^= rotl32 ( x[12] + x[15], 9 );
+        x[14] ^= rotl32 ( x[13] + x[12], 13 );
+        x[15] ^= rotl32 ( x[14] + x[13], 18 );
+    }
+
+    for ( i = 0; i < 16; i++ )
+    {
+        block[i] += x[i];
+    }
+
+    memset ( x, '\0', sizeof ( x ) );
+}
+
+static void scrypt_block_mix ( const uint32_t * src, uint32_t * dst, int r )
+{
+    int i;
+    int j;
+    uint32_t x[16];
+
+    memcpy ( x, src + ( 2 * r - 1 ) * 16, sizeof ( x ) );
+
+    /* Even sub-blocks go to the first half of the output, odd ones to the second */
+    for ( i = 0; i < 2 * r; i++ )
+    {
+        for ( j = 0; j < 16; j++ )
+        {
+            x[j] ^= src[i * 16 + j];
+        }
+
+        salsa20_8 ( x );
+        memcpy ( dst + ( ( i & 1 ) * r + ( i >> 1 ) ) * 16, x, sizeof ( x ) );
+    }
+
+    memset ( x, '\0', sizeof ( x ) );
+}
+
+static void scrypt_ro_mix ( uint8_t * block, int r, size_t n, uint32_t * v, uint32_t * xy )
+{
+    size_t i;
+    size_t j;
+    size_t k;
+    size_t words;
+    uint32_t *x;
+    uint32_t *y;
+
+    words = 32 * r;
+    x = xy;
+    y = xy + words;
+
+    for ( k = 0; k < words; k++ )
+    {
+        x[k] = ( uint32_t ) block[k * 4] | ( ( uint32_t ) block[k * 4 + 1] << 8 )
+            | ( ( uint32_t ) block[k * 4 + 2] << 16 ) | ( ( uint32_t ) block[k * 4 + 3] << 24 );
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        memcpy ( v + i * words, x, words * sizeof ( uint32_t ) );
+        scrypt_block_mix ( x, y, r );
+        memcpy ( x, y, words * sizeof ( uint32_t ) );
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        j = x[( 2 * r - 1 ) * 16] & ( n - 1 );
+
+        for ( k = 0; k < words; k++ )
+        {
+            x[k] ^= v[j * words + k];
+        }
+
+        scrypt_block_mix ( x, y, r );
+        memcpy ( x, y, words * sizeof ( uint32_t ) );
+    }
+
+    for ( k = 0; k < words; k++ )
+    {
+        block[k * 4] = x[k] & 0xff;
+        block[k * 4 + 1] = ( x[k] >> 8 ) & 0xff;
+        block[k * 4 + 2] = ( x[k] >> 16 ) & 0xff;
+        block[k * 4 + 3] = ( x[k] >> 24 ) & 0xff;
+    }
+}
+
+static int scrypt ( const uint8_t * password, size_t password_len, const uint8_t * salt,
+    size_t salt_len, const struct kdf_params_t *params, uint8_t * key, size_t key_size )
+{
+    int i;
+    size_t n;
+    size_t block_size;
+    size_t v_size;
+    size_t xy_size;
+    uint8_t *blocks;
+    uint32_t *v;
+    uint32_t *xy;
+
+    n = ( size_t ) 1 << params->log2_n;
+    block_size = ( size_t ) 128 * params->r;
+    v_size = block_size * n;
+    xy_size = block_size * 2;
+
+    if ( !( blocks = ( uint8_t * ) malloc ( block_size * params->p ) ) )
+    {
+        return -1;
+    }
+
+    if ( !( v = ( uint32_t * ) malloc ( v_size ) ) )
+    {
+        free ( blocks );
+        return -1;
+    }
+
+    if ( !( xy = ( uint32_t * ) malloc ( xy_size ) ) )
+    {
+        free ( v );
+        free ( blocks );
+        return -1;
+    }
+
+    if ( pbkdf2_sha256 ( password, password_len, salt, salt_len, 1, blocks,
+            block_size * params->p ) < 0 )
+    {
+        secure_free_mem ( xy, xy_size );
+        secure_free_mem ( v, v_size );
+        secure_free_mem ( blocks, block_size * params->p );
+        return -1;
+    }
+
+    for ( i = 0; i < params->p; i++ )
+    {
+        scrypt_ro_mix ( blocks + i * block_size, params->r, n, v, xy );
+    }
+
+    if ( pbkdf2_sha256 ( password, password_len, blocks, block_size * params->p, 1, key,
+            key_size ) < 0 )
+    {
+        secure_free_mem ( xy, xy_size );
+        secure_free_mem ( v, v_size );
+        secure_free_mem ( blocks, block_size * params->p );
+        return -1;
+    }
+
+    secure_free_mem ( xy, xy_size );
+    secure_free_mem ( v, v_size );
+    secure_free_mem ( blocks, block_size * params->p );
+    return 0;
+}
+
+int kdf_derive_key ( const char *password, const uint8_t * salt, size_t salt_len,
+    const struct kdf_params_t *params, uint8_t * key, size_t key_size )
+{
+    if ( !kdf_params_valid ( params ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( params->id == KDF_SCRYPT )
+    {
+        return scrypt ( ( const uint8_t * ) password, strlen ( password ), salt, salt_len, params,
+            key, key_size );
+    }
+
+    return pbkdf2_sha256 ( ( const uint8_t * ) password, strlen ( password ), salt, salt_len,
+        params->rounds, key, key_size );
+}
+
+static double elapsed_ms ( const struct timespec *start )
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - start->tv_sec ) * 1000.0 + ( now.tv_nsec - start->tv_nsec ) / 1e6;
+}
+
+int kdf_calibrate ( int id, unsigned int target_ms, struct kdf_params_t *params )
+{
+    double ms;
+    double rounds;
+    struct timespec start;
+    struct kdf_params_t probe;
+    uint8_t salt[32] = { 0 };
+    uint8_t key[32];
+
+    memset ( &probe, '\0', sizeof ( probe ) );
+    probe.id = id;
+
+    if ( id == KDF_SCRYPT )
+    {
+        probe.log2_n = SCRYPT_MIN_LOG2_N;
+        probe.r = SCRYPT_DEFAULT_R;
+        probe.p = SCRYPT_DEFAULT_P;
+
+    } else
+    {
+        probe.id = KDF_PBKDF2_SHA256;
+        probe.rounds = PBKDF2_PROBE_ROUNDS;
+    }
+
+    /* Time a short run and scale it, both functions are linear in cost */
+    clock_gettime ( CLOCK_MONOTONIC, &start );
+
+    if ( kdf_derive_key ( "calibration", salt, sizeof ( salt ), &probe, key, sizeof ( key ) ) < 0 )
+    {
+        return -1;
+    }
+
+    ms = elapsed_ms ( &start );
+    memcpy ( params, &probe, sizeof ( struct kdf_params_t ) );
+
+    if ( id == KDF_SCRYPT )
+    {
+        while ( params->log2_n < SCRYPT_MAX_LOG2_N && ms * 2 <= target_ms )
+        {
+            params->log2_n++;
+            ms *= 2;
+
+            if ( !kdf_params_valid ( params ) )
+            {
+                params->log2_n--;
+                break;
+            }
+        }
+
+    } else
+    {
+        rounds = ms > 0 ? PBKDF2_PROBE_ROUNDS * ( target_ms / ms ) : PBKDF2_MAX_ROUNDS;
+        params->rounds = rounds < PBKDF2_MIN_ROUNDS ? PBKDF2_MIN_ROUNDS
+            : rounds > PBKDF2_MAX_ROUNDS ? PBKDF2_MAX_ROUNDS : ( unsigned int ) rounds;
+    }
+
+    return 0;
+}
@@ -8,6 +8,8 @@
 #include <gtk/gtk.h>
 #include <gdk/gdkkeysyms-compat.h>
 
+#define LIVE_SEARCH_DELAY_MS 150
+
 enum
 {
     TABLE_NAME_COLUMN = 0,
@@ -28,19 +30,42 @@ enum
     RELOAD_DISCARD_PATH
 };
 
+struct save_job_t
+{
+    char path[PATH_SIZE];
+    char password[PASSWORD_SIZE];
+    uint8_t *packed;
+    size_t packed_len;
+    unsigned int database_serial;
+    unsigned int generation;
+    unsigned int serial;
+    unsigned int key_epoch;
+    int result;
+};
+
 struct app_context_t
 {
     int modified;
+    unsigned int database_serial;
+    unsigned int generation;
+    unsigned int save_serial;
+    GThread *save_thread;
+    struct save_job_t *save_pending;
     struct node_t *database;
     struct node_t *node_selected;
     struct node_t *node_parent;
     gchar *last_search_phrase;
+    gchar *live_search_phrase;
+    int live_search_options;
+    unsigned int live_search_generation;
+    guint live_search_timeout;
     GtkWidget *window;
     GtkWidget *rootbox;
     GtkWidget *authbox;
     GtkWidget *passbox;
     GtkWidget *tree_view;
     GtkWidget *table_view;
+    GtkWidget *search_entry;
     GtkTreeViewColumn *tree_name_column;
     char path[PATH_SIZE];
     char password[PASSWORD_SIZE];
@@ -53,6 +78,7 @@ struct app_context_t
     int include_field_name;
     int include_field_value;
     int ignore_whitespaces;
+    int fuzzy_search;
     int shortpass;
 };
 
@@ -101,6 +127,7 @@ static struct holder_t *get_node_parent ( void )
 static void set_modified ( void )
 {
     app_context.modified = TRUE;
+    app_context.generation++;
     gtk_window_set_title ( GTK_WINDOW ( app_context.window ), "*" APPNAME );
 }
 
@@ -110,9 +137,28 @@ static void clear_modified ( void )
     gtk_window_set_title ( GTK_WINDOW ( app_context.window ), APPNAME );
 }
 
+static void forget_live_search ( void )
+{
+    if ( app_context.live_search_phrase )
+    {
+        g_secure_free_string ( app_context.live_search_phrase );
+        app_context.live_search_phrase = NULL;
+    }
+}
+
+static void cancel_live_search ( void )
+{
+    if ( app_context.live_search_timeout )
+    {
+        g_source_remove ( app_context.live_search_timeout );
+        app_context.live_search_timeout = 0;
+    }
+}
+
 static void reset_search ( void )
 {
     search_free ( &app_context.results, &app_context.nresults );
+    forget_live_search (  );
 }
 
 static void free_database ( void )
@@ -863,6 +909,7 @@ static int search_prompt ( int *options, const char *title, gchar ** phrase )
     GtkWidget *include_field_name;
     GtkWidget *include_field_value;
     GtkWidget *ignore_whitespaces;
+    GtkWidget *fuzzy_search;
     size_t size;
     const gchar *text;
     dialog = gtk_message_dialog_new ( GTK_WINDOW ( app_context.window ),
@@ -879,6 +926,11 @@ static int search_prompt ( int *options, const char *title, gchar ** phrase )
         gtk_entry_set_text ( GTK_ENTRY ( entry ), app_context.last_search_phrase );
     }
 
+    fuzzy_search = gtk_check_button_new_with_label ( "~ Fuzzy" );
+    gtk_toggle_button_set_active ( GTK_TOGGLE_BUTTON ( fuzzy_search ), app_context.fuzzy_search );
+    gtk_widget_show ( fuzzy_search );
+    gtk_box_pack_end ( GTK_BOX ( message_area ), fuzzy_search, TRUE, TRUE, 0 );
+
     ignore_whitespaces = gtk_check_button_new_with_label ( "-- Whitespaces" );
     gtk_toggle_button_set_active ( GTK_TOGGLE_BUTTON ( ignore_whitespaces ),
         app_context.ignore_whitespaces );
@@ -949,6 +1001,12 @@ static int search_prompt ( int *options, const char *title, gchar ** phrase )
             *options |= SEARCH_IGNORE_WHITESPACES;
         }
 
+        if ( ( app_context.fuzzy_search =
+                gtk_toggle_button_get_active ( GTK_TOGGLE_BUTTON ( fuzzy_search ) ) ) )
+        {
+            *options |= SEARCH_FUZZY;
+        }
+
         size = strlen ( text ) + 1;
         if ( ( *phrase = ( char * ) malloc ( size ) ) )
         {
@@ -986,10 +1044,17 @@ static void clear_search_history ( void )
         g_secure_free_string ( app_context.last_search_phrase );
         app_context.last_search_phrase = NULL;
     }
+
+    if ( app_context.search_entry )
+    {
+        gtk_entry_set_text ( GTK_ENTRY ( app_context.search_entry ), "" );
+        cancel_live_search (  );
+    }
 }
 
 static void forget_database ( void )
 {
+    app_context.database_serial++;
     clear_search_history (  );
     clear_modified (  );
     app_context.node_selected = NULL;
@@ -1000,6 +1065,7 @@ static void forget_database ( void )
 
 static void forget_file ( void )
 {
+    forget_cached_keys (  );
     memset ( app_context.path, '\0', sizeof ( app_context.path ) );
     memset ( app_context.password, '\0', sizeof ( app_context.password ) );
 }
@@ -1010,8 +1076,125 @@ static void forget_database_and_file ( void )
     forget_file (  );
 }
 
+static void free_save_job ( struct save_job_t *job )
+{
+    secure_free_mem ( job->packed, job->packed_len );
+    secure_free_mem ( job, sizeof ( struct save_job_t ) );
+}
+
+static gpointer save_worker ( gpointer data );
+
+static void start_save_job ( struct save_job_t *job )
+{
+    job->serial = ++app_context.save_serial;
+    app_context.save_thread = g_thread_new ( "save", save_worker, job );
+}
+
+static void finish_save_job ( struct save_job_t *job )
+{
+    if ( job->database_serial == app_context.database_serial )
+    {
+        if ( job->result >= 0 )
+        {
+            /* Edits made while the worker was busy are not in this file */
+            if ( job->generation == app_context.generation )
+            {
+                clear_modified (  );
+            }
+            strncpy ( app_context.path, job->path, sizeof ( app_context.path ) - 1 );
+            strncpy ( app_context.password, job->password, sizeof ( app_context.password ) - 1 );
+        } else
+        {
+            failure ( "Unable to save database" );
+        }
+    }
+
+    free_save_job ( job );
+
+    if ( app_context.save_pending )
+    {
+        job = app_context.save_pending;
+        app_context.save_pending = NULL;
+        start_save_job ( job );
+    }
+}
+
+static gboolean save_on_finished ( gpointer data )
+{
+    if ( app_context.save_thread && GPOINTER_TO_UINT ( data ) == app_context.save_serial )
+    {
+        struct save_job_t *job = ( struct save_job_t * ) g_thread_join ( app_context.save_thread );
+        app_context.save_thread = NULL;
+        finish_save_job ( job );
+    }
+
+    return FALSE;
+}
+
+static gpointer save_worker ( gpointer data )
+{
+    struct save_job_t *job = ( struct save_job_t * ) data;
+
+    job->result = save_packed_database ( job->path, job->packed, job->packed_len, job->password,
+        job->key_epoch );
+    g_idle_add ( save_on_finished, GUINT_TO_POINTER ( job->serial ) );
+    return job;
+}
+
+static void wait_for_saves ( void )
+{
+    struct save_job_t *job;
+
+    while ( app_context.save_thread )
+    {
+        job = ( struct save_job_t * ) g_thread_join ( app_context.save_thread );
+        app_context.save_thread = NULL;
+        finish_save_job ( job );
+    }
+}
+
+static int save_database_async ( const char *path, const char *password )
+{
+    struct save_job_t *job;
+
+    if ( !( job = ( struct save_job_t * ) calloc ( 1, sizeof ( struct save_job_t ) ) ) )
+    {
+        return -1;
+    }
+
+    /* Snapshot the tree here, the worker never touches live nodes */
+    if ( pack_tree ( app_context.database, &job->packed, &job->packed_len ) < 0 )
+    {
+        free ( job );
+        return -1;
+    }
+
+    strncpy ( job->path, path, sizeof ( job->path ) - 1 );
+    strncpy ( job->password, password, sizeof ( job->password ) - 1 );
+    job->database_serial = app_context.database_serial;
+    job->generation = app_context.generation;
+    job->key_epoch = get_key_cache_epoch (  );
+
+    if ( app_context.save_thread )
+    {
+        /* Only the newest snapshot matters once the running save lands */
+        if ( app_context.save_pending )
+        {
+            free_save_job ( app_context.save_pending );
+        }
+        app_context.save_pending = job;
+
+    } else
+    {
+        start_save_job ( job );
+    }
+
+    return 0;
+}
+
 static void app_quit_discard ( void )
 {
+    wait_for_saves (  );
     forget_database_and_file (  );
     reset_context (  );
     gtk_main_quit (  );
@@ -1019,6 +1202,8 @@ static void app_quit_discard ( void )
 
 static void app_quit ( void )
 {
+    wait_for_saves (  );
+
     if ( can_create_new_database (  ) )
     {
         app_quit_discard (  );
@@ -1034,6 +1219,15 @@ static gboolean window_on_deleted ( GtkWidget * widget, GdkEvent * event, gpoint
     return TRUE;
 }
 
+/* Keys typed into the live search entry reach it before the menu accelerators */
+static gboolean window_on_key_press ( GtkWidget * widget, GdkEventKey * event, gpointer data )
+{
+    UNUSED ( data );
+
+    return gtk_window_get_focus ( GTK_WINDOW ( widget ) ) == app_context.search_entry
+        && gtk_window_propagate_key_event ( GTK_WINDOW ( widget ), event );
+}
+
 static const char *altername ( const char *name )
 {
     if ( !name || !name[0] || name[1] )
@@ -1244,29 +1438,15 @@ static void save_file ( const char *path, struct node_t *branch )
         return;
     }
 
-    if ( save_database ( path, branch, password ) >= 0 )
-    {
-        if ( branch == app_context.database )
-        {
-            clear_modified (  );
-            if ( path != app_context.path )
-            {
-                strncpy ( app_context.path, path, sizeof ( app_context.path ) - 1 );
-            }
-            if ( password != app_context.password )
-            {
-                strncpy ( app_context.password, password, sizeof ( app_context.password ) - 1 );
-            }
-        }
-    } else
+    if ( branch == app_context.database )
     {
-        if ( branch == app_context.database )
+        if ( save_database_async ( path, password ) < 0 )
         {
             failure ( "Unable to save database" );
-        } else
-        {
-            failure ( "Unable to export branch" );
         }
+    } else if ( save_database ( path, branch, password ) < 0 )
+    {
+        failure ( "Unable to export branch" );
     }
 
     if ( password != app_context.password )
@@ -1500,6 +1680,153 @@ static void menu_search_root ( GtkMenuItem * menu_item, gpointer data )
     }
 }
 
+static int get_search_options ( void )
+{
+    int options = 0;
+
+    if ( app_context.include_holder_name )
+    {
+        options |= SEARCH_HOLDER_NAME;
+    }
+
+    if ( app_context.include_leaf_name )
+    {
+        options |= SEARCH_LEAF_NAME;
+    }
+
+    if ( app_context.include_field_name )
+    {
+        options |= SEARCH_FIELD_NAME;
+    }
+
+    if ( app_context.include_field_value )
+    {
+        options |= SEARCH_FIELD_VALUE;
+    }
+
+    if ( app_context.ignore_whitespaces )
+    {
+        options |= SEARCH_IGNORE_WHITESPACES;
+    }
+
+    if ( app_context.fuzzy_search )
+    {
+        options |= SEARCH_FUZZY;
+    }
+
+    return options;
+}
+
+/*
+ * The live entry searches the root with the options of the last search
+ * dialog. A phrase that extends the one shown can only match some of its
+ * results, so those are filtered again unless the tree changed meanwhile.
+ * Ranked fuzzy results are only the best ones and always searched again.
+ */
+static int can_refine_search ( int options, const char *phrase )
+{
+    return app_context.live_search_phrase && ( ~options & SEARCH_FUZZY )
+        && app_context.live_search_options == options
+        && app_context.live_search_generation == get_tree_generation (  )
+        && !strncmp ( phrase, app_context.live_search_phrase,
+        strlen ( app_context.live_search_phrase ) );
+}
+
+static void live_search ( void )
+{
+    int ret;
+    int options;
+    size_t size;
+    gchar *phrase;
+    const gchar *text;
+
+    text = gtk_entry_get_text ( GTK_ENTRY ( app_context.search_entry ) );
+
+    if ( !text || !text[0] )
+    {
+        if ( app_context.live_search_phrase )
+        {
+            update_table (  );
+        }
+        return;
+    }
+
+    size = strlen ( text ) + 1;
+    if ( !( phrase = ( char * ) malloc ( size ) ) )
+    {
+        failure ( "Search failed" );
+        return;
+    }
+    memcpy ( phrase, text, size );
+
+    options = get_search_options (  );
+
+    if ( can_refine_search ( options, phrase ) )
+    {
+        forget_live_search (  );
+        ret = search_refine ( options, phrase, app_context.live_search_generation,
+            app_context.results, &app_context.nresults );
+    } else
+    {
+        reset_search (  );
+        app_context.search_base_length = 0;
+        ret = search_run ( app_context.database, options, phrase, &app_context.results,
+            &app_context.nresults );
+    }
+
+    if ( ret < 0 )
+    {
+        g_secure_free_string ( phrase );
+        reset_search (  );
+        failure ( "Search failed" );
+        return;
+    }
+
+    app_context.live_search_phrase = phrase;
+    app_context.live_search_options = options;
+    app_context.live_search_generation = get_tree_generation (  );
+    fill_search_results (  );
+}
+
+static gboolean live_search_on_timeout ( gpointer data )
+{
+    UNUSED ( data );
+    app_context.live_search_timeout = 0;
+    live_search (  );
+    return FALSE;
+}
+
+/* Each keystroke restarts the delay, so a search only runs once typing pauses */
+static void live_search_on_changed ( GtkEditable * editable, gpointer data )
+{
+    UNUSED ( editable );
+    UNUSED ( data );
+    cancel_live_search (  );
+    app_context.live_search_timeout =
+        g_timeout_add ( LIVE_SEARCH_DELAY_MS, live_search_on_timeout, NULL );
+}
+
+static void live_search_on_activate ( GtkEntry * entry, gpointer data )
+{
+    UNUSED ( entry );
+    UNUSED ( data );
+
+    if ( app_context.live_search_timeout )
+    {
+        cancel_live_search (  );
+        live_search (  );
+    }
+
+    gtk_widget_grab_focus ( app_context.table_view );
+}
+
+static void menu_live_search ( GtkMenuItem * menu_item, gpointer data )
+{
+    UNUSED ( menu_item );
+    UNUSED ( data );
+    gtk_widget_grab_focus ( app_context.search_entry );
+}
+
 static int set_search_base_to_selected ( void )
 {
     int i;
@@ -2292,6 +2619,7 @@ static void menu_paste_as_tsv ( GtkMenuItem * menu_item, gpointer data )
         {
             paste_as_tsv ( ( struct leaf_t * ) app_context.node_selected, tsv, &stats );
             g_free ( tsv );
+            set_modified (  );
             reload_table ( -1 );
             focus_table (  );
             show_database_stats ( &stats, FALSE );
@@ -2567,6 +2895,8 @@ static void add_menu_item ( GtkWidget * submenu, const char *name, GCallback cal
 
 static void app_lock ( void )
 {
+    forget_cached_keys (  );
+
     if ( app_context.window )
     {
         gtk_widget_hide ( app_context.rootbox );
@@ -2630,7 +2960,112 @@ static gboolean auth_on_key_press ( GtkWidget * widget, GdkEventKey * event, gpo
 
 static void show_usage ( void )
 {
-    fprintf ( stderr, "usage: passnote [database]\n" );
+    fprintf ( stderr, "usage: passnote [options] [database]\n"
+        "\n"
+        "options:\n"
+        "  --cipher cbc|gcm|chacha20        cipher used when saving\n"
+        "  --codec lz4|lz4hc|zstd           compression used when saving\n"
+        "  --level n                        compression level, zero for the codec default\n"
+        "  --kdf pbkdf2|scrypt              key derivation for new keys\n"
+        "  --unlock-ms ms                   calibrate key derivation to this unlock time\n"
+        "  --zero-copy                      keep the decrypted database as backing store\n"
+        "  --allow-empty-passwords-anyway   allow saving without encryption\n" );
+}
+
+static int parse_options ( int argc, char *argv[], const char **path )
+{
+    int i;
+    struct storage_options_t options;
+
+    storage_default_options ( &options );
+
+    for ( i = 1; i < argc; i++ )
+    {
+        if ( !strcmp ( argv[i], "--allow-empty-passwords-anyway" ) )
+        {
+            allow_empty_password_anyway = TRUE;
+
+        } else if ( !strcmp ( argv[i], "--zero-copy" ) )
+        {
+            options.zero_copy = TRUE;
+
+        } else if ( !strcmp ( argv[i], "--kdf" ) && i + 1 < argc )
+        {
+            if ( !strcmp ( argv[++i], "pbkdf2" ) )
+            {
+                options.kdf = KDF_PBKDF2_SHA256;
+
+            } else if ( !strcmp ( argv[i], "scrypt" ) )
+            {
+                options.kdf = KDF_SCRYPT;
+
+            } else
+            {
+                return -1;
+            }
+
+        } else if ( !strcmp ( argv[i], "--cipher" ) && i + 1 < argc )
+        {
+            if ( !strcmp ( argv[++i], "gcm" ) )
+            {
+                options.cipher = CIPHER_AES256_GCM;
+
+            } else if ( !strcmp ( argv[i], "chacha20" ) )
+            {
+                options.cipher = CIPHER_CHACHA20_POLY1305;
+
+            } else if ( !strcmp ( argv[i], "cbc" ) )
+            {
+                options.cipher = CIPHER_AES256_CBC;
+
+            } else
+            {
+                return -1;
+            }
+
+        } else if ( !strcmp ( argv[i], "--codec" ) && i + 1 < argc )
+        {
+            if ( !strcmp ( argv[++i], "lz4" ) )
+            {
+                options.codec = CODEC_LZ4;
+
+            } else if ( !strcmp ( argv[i], "lz4hc" ) )
+            {
+                options.codec = CODEC_LZ4HC;
+
+            } else if ( !strcmp ( argv[i], "zstd" ) )
+            {
+                options.codec = CODEC_ZSTD;
+
+            } else
+            {
+                return -1;
+            }
+
+        } else if ( !strcmp ( argv[i], "--level" ) && i + 1 < argc )
+        {
+            options.level = atoi ( argv[++i] );
+
+        } else if ( !strcmp ( argv[i], "--unlock-ms" ) && i + 1 < argc )
+        {
+            if ( atoi ( argv[++i] ) <= 0 )
+            {
+                return -1;
+            }
+            options.unlock_ms = atoi ( argv[i] );
+
+        } else if ( argv[i][0] != '-' && !*path )
+        {
+            *path = argv[i];
+
+        } else
+        {
+            return -1;
+        }
+    }
+
+    set_storage_options ( &options );
+    return 0;
 }
 
 void label_set_fontsize ( GtkWidget * label, int fontsize )
@@ -2658,11 +3093,13 @@ int main ( int argc, char *argv[] )
     GtkWidget *hbox;
     GtkWidget *tree_scrolled_window;
     GtkWidget *table_scrolled_window;
+    GtkWidget *table_box;
     GtkAccelGroup *accel_group;
     GdkPixbuf *pixbuf;
     GtkWidget *mainbox;
     GtkWidget *entrybox;
     GtkWidget *authlabel;
+    const char *path = NULL;
 
     if ( argc >= 2 && ( !strcmp ( argv[1], "-h" ) || !strcmp ( argv[1], "--help" ) ) )
     {
@@ -2670,6 +3107,12 @@ int main ( int argc, char *argv[] )
         return 0;
     }
 
+    if ( parse_options ( argc, argv, &path ) < 0 )
+    {
+        show_usage (  );
+        return 1;
+    }
+
     reset_context (  );
     gtk_init ( 0, NULL );
     signal ( SIGINT, SIG_IGN );
@@ -2713,6 +3156,8 @@ int main ( int argc, char *argv[] )
     tree_menu = gtk_menu_item_new_with_label ( "Tree" );
     tree_submenu = gtk_menu_new (  );
 
+    add_menu_item ( tree_submenu, "Live Search", G_CALLBACK ( menu_live_search ),
+        accel_group, GDK_k, GDK_CONTROL_MASK );
     add_menu_item ( tree_submenu, "Search Root", G_CALLBACK ( menu_search_root ),
         accel_group, GDK_f, GDK_CONTROL_MASK );
     add_menu_item ( tree_submenu, "Search Branch", G_CALLBACK ( menu_search_branch ),
@@ -2805,9 +3250,20 @@ int main ( int argc, char *argv[] )
     gtk_widget_set_size_request ( tree_scrolled_window, 300, 2 );
     gtk_container_add ( GTK_CONTAINER ( tree_scrolled_window ), app_context.tree_view );
     gtk_box_pack_start ( GTK_BOX ( hbox ), tree_scrolled_window, FALSE, TRUE, 2 );
+    table_box = VBOX_NEW;
+    app_context.search_entry = gtk_entry_new (  );
+#ifndef CONFIG_USE_GTK2
+    gtk_entry_set_placeholder_text ( GTK_ENTRY ( app_context.search_entry ), "Search (Ctrl+K)" );
+#endif
+    g_signal_connect ( app_context.search_entry, "changed",
+        G_CALLBACK ( live_search_on_changed ), NULL );
+    g_signal_connect ( app_context.search_entry, "activate",
+        G_CALLBACK ( live_search_on_activate ), NULL );
+    gtk_box_pack_start ( GTK_BOX ( table_box ), app_context.search_entry, FALSE, FALSE, 2 );
     table_scrolled_window = gtk_scrolled_window_new ( NULL, NULL );
     gtk_container_add ( GTK_CONTAINER ( table_scrolled_window ), app_context.table_view );
-    gtk_box_pack_start ( GTK_BOX ( hbox ), table_scrolled_window, TRUE, TRUE, 0 );
+    gtk_box_pack_start ( GTK_BOX ( table_box ), table_scrolled_window, TRUE, TRUE, 0 );
+    gtk_box_pack_start ( GTK_BOX ( hbox ), table_box, TRUE, TRUE, 0 );
     gtk_box_pack_start ( GTK_BOX ( app_context.rootbox ), hbox, TRUE, TRUE, 0 );
     gtk_box_pack_start ( GTK_BOX ( mainbox ), app_context.rootbox, TRUE, TRUE, 0 );
 
@@ -2828,22 +3284,17 @@ int main ( int argc, char *argv[] )
     gtk_box_pack_start ( GTK_BOX ( mainbox ), app_context.authbox, TRUE, FALSE, 0 );
 
     g_signal_connect ( app_context.window, "delete-event", G_CALLBACK ( window_on_deleted ), NULL );
+    g_signal_connect ( app_context.window, "key-press-event", G_CALLBACK ( window_on_key_press ),
+        NULL );
     gtk_container_add ( GTK_CONTAINER ( app_context.window ), mainbox );
     gtk_widget_show_all ( app_context.rootbox );
     gtk_widget_show_all ( entrybox );
     gtk_widget_show ( mainbox );
     gtk_widget_show ( app_context.window );
 
-    if ( argc >= 2 )
+    if ( path && !open_file_by_path ( path ) )
     {
-        if ( !strcmp ( argv[1], "--allow-empty-passwords-anyway" ) )
-        {
-            allow_empty_password_anyway = TRUE;
-
-        } else if ( !open_file_by_path ( argv[1] ) )
-        {
-            return 1;
-        }
+        return 1;
     }
 
     if ( !app_context.database && new_file (  ) < 0 )
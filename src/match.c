@@ -0,0 +1,343 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Search Phrase Matching
+ * ------------------------------------------------------------------ */
+
+#include "match.h"
+#include "util.h"
+#include <pthread.h>
+
+#if defined ( __GNUC__ ) && ( defined ( __x86_64__ ) || defined ( __i386__ ) )
+#define MATCH_X86
+#include <immintrin.h>
+#endif
+
+#define MATCH_SCORE_CHAR 16
+#define MATCH_SCORE_RUN 8
+#define MATCH_SCORE_WORD 8
+#define MATCH_SCORE_EXACT 32
+#define MATCH_SCORE_SKIP 24
+#define MATCH_GAP_MAX 8
+
+/*
+ * The needle is folded once when the search starts, without blanks when
+ * they are ignored. Kernels look for haystack offsets where the first byte
+ * matches, and in plain mode the last byte too, then compare the rest.
+ * Only ASCII letters are folded, as tolower does in the C and UTF-8 locales.
+ */
+typedef int ( *match_kernel_t ) ( const struct match_t *, const char *, size_t );
+
+static int match_scalar ( const struct match_t *match, const char *text, size_t len );
+static match_kernel_t match_kernel = match_scalar;
+static pthread_once_t match_once = PTHREAD_ONCE_INIT;
+
+static int fold_char ( uint8_t c )
+{
+    return MATCH_FOLD ( c );
+}
+
+static int is_blank_char ( uint8_t c )
+{
+    return MATCH_BLANK ( c );
+}
+
+/* Bit that folds a needle byte when set on the haystack, none for non letters */
+static uint8_t case_bit ( uint8_t c )
+{
+    return c >= 'a' && c <= 'z' ? 'a' - 'A' : 0;
+}
+
+/* Candidate offsets leave at least the needle length before the end */
+static int match_rest ( const struct match_t *match, const char *text )
+{
+    size_t i;
+
+    for ( i = 1; i < match->len; i++ )
+    {
+        if ( fold_char ( ( uint8_t ) text[i] ) != ( uint8_t ) match->needle[i] )
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static int match_rest_blanks ( const struct match_t *match, const char *text )
+{
+    size_t i;
+    const uint8_t *ptr;
+
+    for ( i = 1, ptr = ( const uint8_t * ) text + 1; i < match->len; ptr++ )
+    {
+        if ( !*ptr )
+        {
+            return FALSE;
+        }
+
+        if ( is_blank_char ( *ptr ) )
+        {
+            continue;
+        }
+
+        if ( fold_char ( *ptr ) != ( uint8_t ) match->needle[i] )
+        {
+            return FALSE;
+        }
+
+        i++;
+    }
+
+    return TRUE;
+}
+
+static int match_candidate ( const struct match_t *match, const char *text )
+{
+    return match->ignore_blanks ? match_rest_blanks ( match, text ) : match_rest ( match, text );
+}
+
+static int match_scan ( const struct match_t *match, const char *text, size_t len, size_t from )
+{
+    size_t i;
+    size_t last;
+
+    last = len - match->len + 1;
+
+    for ( i = from; i < last; i++ )
+    {
+        if ( fold_char ( ( uint8_t ) text[i] ) == ( uint8_t ) match->needle[0]
+            && match_candidate ( match, text + i ) )
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static int match_scalar ( const struct match_t *match, const char *text, size_t len )
+{
+    return match_scan ( match, text, len, 0 );
+}
+
+#ifdef MATCH_X86
+
+/*
+ * Both filter bytes are compared for a whole block of offsets at once. With
+ * blanks ignored the last byte may sit anywhere, the first one is used twice.
+ */
+__attribute__ ( ( target ( "sse2" ) ) )
+static int match_sse2 ( const struct match_t *match, const char *text, size_t len )
+{
+    size_t i;
+    size_t last;
+    size_t tail;
+    uint32_t bits;
+    __m128i first;
+    __m128i first_case;
+    __m128i final;
+    __m128i final_case;
+    __m128i block;
+
+    tail = match->ignore_blanks ? 0 : match->len - 1;
+    last = len - match->len + 1;
+    first = _mm_set1_epi8 ( match->needle[0] );
+    first_case = _mm_set1_epi8 ( case_bit ( match->needle[0] ) );
+    final = _mm_set1_epi8 ( match->needle[tail] );
+    final_case = _mm_set1_epi8 ( case_bit ( match->needle[tail] ) );
+
+    for ( i = 0; i + 16 <= last; i += 16 )
+    {
+        block = _mm_and_si128 ( _mm_cmpeq_epi8 ( first,
+                _mm_or_si128 ( _mm_loadu_si128 ( ( const __m128i * ) ( text + i ) ),
+                    first_case ) ), _mm_cmpeq_epi8 ( final,
+                _mm_or_si128 ( _mm_loadu_si128 ( ( const __m128i * ) ( text + i + tail ) ),
+                    final_case ) ) );
+
+        for ( bits = _mm_movemask_epi8 ( block ); bits; bits &= bits - 1 )
+        {
+            if ( match_candidate ( match, text + i + __builtin_ctz ( bits ) ) )
+            {
+                return TRUE;
+            }
+        }
+    }
+
+    return match_scan ( match, text, len, i );
+}
+
+__attribute__ ( ( target ( "avx2" ) ) )
+static int match_avx2 ( const struct match_t *match, const char *text, size_t len )
+{
+    size_t i;
+    size_t last;
+    size_t tail;
+    uint32_t bits;
+    __m256i first;
+    __m256i first_case;
+    __m256i final;
+    __m256i final_case;
+    __m256i block;
+
+    tail = match->ignore_blanks ? 0 : match->len - 1;
+    last = len - match->len + 1;
+    first = _mm256_set1_epi8 ( match->needle[0] );
+    first_case = _mm256_set1_epi8 ( case_bit ( match->needle[0] ) );
+    final = _mm256_set1_epi8 ( match->needle[tail] );
+    final_case = _mm256_set1_epi8 ( case_bit ( match->needle[tail] ) );
+
+    for ( i = 0; i + 32 <= last; i += 32 )
+    {
+        block = _mm256_and_si256 ( _mm256_cmpeq_epi8 ( first,
+                _mm256_or_si256 ( _mm256_loadu_si256 ( ( const __m256i * ) ( text + i ) ),
+                    first_case ) ), _mm256_cmpeq_epi8 ( final,
+                _mm256_or_si256 ( _mm256_loadu_si256 ( ( const __m256i * ) ( text + i + tail ) ),
+                    final_case ) ) );
+
+        for ( bits = _mm256_movemask_epi8 ( block ); bits; bits &= bits - 1 )
+        {
+            if ( match_candidate ( match, text + i + __builtin_ctz ( bits ) ) )
+            {
+                _mm256_zeroupper (  );
+                return TRUE;
+            }
+        }
+    }
+
+    /* Not always emitted for target functions, SSE code stalls on dirty upper halves */
+    _mm256_zeroupper (  );
+    return match_sse2 ( match, text + i, len - i );
+}
+
+#endif
+
+static void match_dispatch ( void )
+{
+#ifdef MATCH_X86
+    __builtin_cpu_init (  );
+
+    if ( __builtin_cpu_supports ( "avx2" ) )
+    {
+        match_kernel = match_avx2;
+    } else if ( __builtin_cpu_supports ( "sse2" ) )
+    {
+        match_kernel = match_sse2;
+    }
+#endif
+}
+
+int match_init ( struct match_t *match, const char *needle, int ignore_blanks )
+{
+    size_t len = 0;
+
+    pthread_once ( &match_once, match_dispatch );
+
+    if ( !( match->needle = ( char * ) malloc ( strlen ( needle ) + 1 ) ) )
+    {
+        return -1;
+    }
+
+    for ( ; *needle; needle++ )
+    {
+        if ( !ignore_blanks || !is_blank_char ( ( uint8_t ) * needle ) )
+        {
+            match->needle[len++] = fold_char ( ( uint8_t ) * needle );
+        }
+    }
+
+    match->needle[len] = '\0';
+    match->len = len;
+    match->ignore_blanks = ignore_blanks;
+    return 0;
+}
+
+int match_test ( const struct match_t *match, const char *haystack )
+{
+    size_t len;
+
+    /* A phrase of blanks only still needs some text when blanks are ignored */
+    if ( !match->len )
+    {
+        return !match->ignore_blanks || *haystack;
+    }
+
+    if ( ( len = strlen ( haystack ) ) < match->len )
+    {
+        return FALSE;
+    }
+
+    return match_kernel ( match, haystack, len );
+}
+
+static const uint8_t *find_folded ( const uint8_t *text, uint8_t c )
+{
+    char set[3] = { ( char ) c, ( char ) ( c - case_bit ( c ) ), '\0' };
+
+    return ( const uint8_t * ) ( case_bit ( c ) ? strpbrk ( ( const char * ) text, set )
+        : strchr ( ( const char * ) text, c ) );
+}
+
+/*
+ * Fuzzy matches take the needle as a subsequence of the haystack, placing
+ * each byte as early as it goes. A needle byte that is not found further on
+ * is skipped at a cost, one per four needle bytes at most, which covers
+ * typos, swapped and extra letters. Runs, word starts and a plain substring
+ * raise the score, gaps lower it. Zero means no match.
+ */
+int match_score ( const struct match_t *match, const char *haystack )
+{
+    int score = 0;
+    size_t i;
+    size_t gap;
+    size_t skips = 0;
+    const uint8_t *ptr;
+    const uint8_t *found;
+    const uint8_t *last = NULL;
+
+    if ( !match->len )
+    {
+        return !!*haystack;
+    }
+
+    for ( i = 0, ptr = ( const uint8_t * ) haystack; i < match->len; i++ )
+    {
+        if ( !( found = find_folded ( ptr, match->needle[i] ) ) )
+        {
+            if ( ++skips > match->len / 4 )
+            {
+                return 0;
+            }
+            score -= MATCH_SCORE_SKIP;
+            continue;
+        }
+
+        score += MATCH_SCORE_CHAR;
+
+        if ( found == ( const uint8_t * ) haystack || !isalnum ( found[-1] ) )
+        {
+            score += MATCH_SCORE_WORD;
+        }
+
+        if ( last )
+        {
+            gap = found - last - 1;
+            score -= gap < MATCH_GAP_MAX ? ( int ) gap : MATCH_GAP_MAX;
+            score += gap ? 0 : MATCH_SCORE_RUN;
+        }
+
+        last = found;
+        ptr = found + 1;
+    }
+
+    if ( !skips && match_test ( match, haystack ) )
+    {
+        score += MATCH_SCORE_EXACT;
+    }
+
+    return score > 0 ? score : 1;
+}
+
+void match_free ( struct match_t *match )
+{
+    secure_free_string ( match->needle );
+    match->needle = NULL;
+}
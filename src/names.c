@@ -0,0 +1,208 @@
+/* ------------------------------------------------------------------
+ * Pass Note - Interned Field Names
+ * ------------------------------------------------------------------ */
+
+#include "names.h"
+#include "util.h"
+#include <pthread.h>
+
+#define NAMES_BUCKETS_MIN 256
+
+/*
+ * Every distinct field name is stored once and shared by reference. Names
+ * that differ only in case share an id, so fields compare with an integer
+ * where they used to strcasecmp. Ids are never reused, an id stays valid
+ * for as long as any name carrying it is alive.
+ */
+struct name_entry_t
+{
+    struct name_entry_t *next;
+    char *name;
+    size_t len;
+    size_t hash;
+    size_t refs;
+    int id;
+};
+
+static struct name_entry_t **names_buckets = NULL;
+static size_t names_nbuckets = 0;
+static size_t names_count = 0;
+static int names_last_id = 0;
+static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t name_hash ( const char *name, size_t len )
+{
+    size_t i;
+    size_t hash = 2166136261u;
+
+    for ( i = 0; i < len; i++ )
+    {
+        hash ^= ( uint8_t ) tolower ( ( uint8_t ) name[i] );
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void grow_names ( void )
+{
+    size_t i;
+    size_t nbuckets;
+    struct name_entry_t **buckets;
+    struct name_entry_t *entry;
+    struct name_entry_t *next;
+
+    nbuckets = names_nbuckets ? names_nbuckets << 1 : NAMES_BUCKETS_MIN;
+
+    /* Longer chains are only slower, keep the old table on failure */
+    if ( !( buckets = ( struct name_entry_t ** ) calloc ( nbuckets,
+                sizeof ( struct name_entry_t * ) ) ) )
+    {
+        return;
+    }
+
+    for ( i = 0; i < names_nbuckets; i++ )
+    {
+        for ( entry = names_buckets[i]; entry; entry = next )
+        {
+            next = entry->next;
+            entry->next = buckets[entry->hash & ( nbuckets - 1 )];
+            buckets[entry->hash & ( nbuckets - 1 )] = entry;
+        }
+    }
+
+    free ( names_buckets );
+    names_buckets = buckets;
+    names_nbuckets = nbuckets;
+}
+
+char *intern_name ( const char *name, size_t len, int *id )
+{
+    int fold_id = 0;
+    size_t hash;
+    struct name_entry_t *entry;
+
+    hash = name_hash ( name, len );
+
+    pthread_mutex_lock ( &names_mutex );
+
+    if ( names_count >= names_nbuckets )
+    {
+        grow_names (  );
+    }
+
+    if ( !names_buckets )
+    {
+        pthread_mutex_unlock ( &names_mutex );
+        return NULL;
+    }
+
+    for ( entry = names_buckets[hash & ( names_nbuckets - 1 )]; entry; entry = entry->next )
+    {
+        if ( entry->hash != hash || entry->len != len )
+        {
+            continue;
+        }
+
+        if ( !memcmp ( entry->name, name, len ) )
+        {
+            entry->refs++;
+            *id = entry->id;
+            pthread_mutex_unlock ( &names_mutex );
+            return entry->name;
+        }
+
+        if ( !strncasecmp ( entry->name, name, len ) )
+        {
+            fold_id = entry->id;
+        }
+    }
+
+    if ( !( entry = ( struct name_entry_t * ) calloc ( 1, sizeof ( struct name_entry_t ) ) ) )
+    {
+        pthread_mutex_unlock ( &names_mutex );
+        return NULL;
+    }
+
+    if ( !( entry->name = ( char * ) malloc ( len + 1 ) ) )
+    {
+        free ( entry );
+        pthread_mutex_unlock ( &names_mutex );
+        return NULL;
+    }
+
+    memcpy ( entry->name, name, len );
+    entry->name[len] = '\0';
+    entry->len = len;
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->id = fold_id ? fold_id : ++names_last_id;
+    entry->next = names_buckets[hash & ( names_nbuckets - 1 )];
+    names_buckets[hash & ( names_nbuckets - 1 )] = entry;
+    names_count++;
+
+    *id = entry->id;
+    pthread_mutex_unlock ( &names_mutex );
+    return entry->name;
+}
+
+int lookup_name_id ( const char *name )
+{
+    int id = 0;
+    size_t len;
+    size_t hash;
+    struct name_entry_t *entry;
+
+    len = strlen ( name );
+    hash = name_hash ( name, len );
+
+    pthread_mutex_lock ( &names_mutex );
+
+    for ( entry = names_buckets ? names_buckets[hash & ( names_nbuckets - 1 )] : NULL; entry;
+        entry = entry->next )
+    {
+        if ( entry->hash == hash && entry->len == len && !strncasecmp ( entry->name, name, len ) )
+        {
+            id = entry->id;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock ( &names_mutex );
+    return id;
+}
+
+void release_name ( const char *name )
+{
+    size_t hash;
+    struct name_entry_t **ptr;
+    struct name_entry_t *entry;
+
+    if ( !name )
+    {
+        return;
+    }
+
+    hash = name_hash ( name, strlen ( name ) );
+
+    pthread_mutex_lock ( &names_mutex );
+
+    for ( ptr = &names_buckets[hash & ( names_nbuckets - 1 )]; *ptr; ptr = &( *ptr )->next )
+    {
+        entry = *ptr;
+
+        if ( entry->name == name )
+        {
+            if ( !--entry->refs )
+            {
+                *ptr = entry->next;
+                secure_free_mem ( entry->name, entry->len + 1 );
+                free ( entry );
+                names_count--;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock ( &names_mutex );
+}
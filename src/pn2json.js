@@ -35,6 +35,27 @@ function scan_zerostring(stack) {
     return Buffer.from(result).toString('utf8');
 }
 
+function scan_varint(stack) {
+    let value = 0;
+    let scale = 1;
+    for (let i = 0; i < 10; i++) {
+        if (stack.pos >= stack.array.length) {
+            throw new Error();
+        }
+        const byte = stack.array[stack.pos++];
+        value += (byte & 0x7f) * scale;
+        scale *= 128;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw new Error();
+}
+
+function scan_sizedstring(stack) {
+    return scan_nonzerostring(stack, scan_varint(stack));
+}
+
 function scan_number(stack) {
     return parseInt(scan_zerostring(stack), 16);
 }
@@ -107,19 +128,73 @@ function unpack_node(stack, hasnext) {
     }
 }
 
+function unpack_field_v2(stack) {
+    const modified = scan_varint(stack);
+    let name;
+    if (stack.names) {
+        name = stack.names[scan_varint(stack)];
+        if (name === undefined) {
+            throw new Error();
+        }
+    } else {
+        name = scan_sizedstring(stack);
+    }
+    const value = scan_sizedstring(stack);
+    return {
+        name: name,
+        value: value,
+        modified: modified | 0
+    };
+}
+
+function unpack_node_v2(stack) {
+    const tag = scan_nonzerostring(stack, 1);
+    const name = scan_sizedstring(stack);
+    let count = scan_varint(stack);
+    if (tag === 'l') {
+        const leaf = {
+            leaf: true,
+            name: name,
+            fields: []
+        };
+        while (count--) {
+            leaf.fields.push(unpack_field_v2(stack));
+        }
+        return leaf;
+    }
+    if (tag === 'h') {
+        const holder = {
+            leaf: false,
+            name: name,
+            children: []
+        };
+        while (count--) {
+            holder.children.push(unpack_node_v2(stack));
+        }
+        return holder;
+    }
+    throw new Error();
+}
+
 function unpack_tree(stack) {
     const magic = scan_nonzerostring(stack, 8);
-    if (magic[0] !== 'P' ||
-        magic[1] !== 'A' ||
-        magic[2] !== 'S' ||
-        magic[3] !== 'S' ||
-        magic[4] !== 'N' ||
-        magic[5] !== 'O' ||
-        magic[6] !== 'T' ||
-        magic[7] !== 'E') {
+    if (magic !== 'PASSNOTE' && magic !== 'PASSNOT2') {
         throw new Error();
     }
-    const result = unpack_node(stack, {});
+    if (magic === 'PASSNOT2' && peek_byte(stack) === 'D') {
+        stack.pos++;
+        stack.names = [];
+        for (let count = scan_varint(stack); count > 0; count--) {
+            stack.names.push(scan_sizedstring(stack));
+        }
+    }
+    if (magic === 'PASSNOT2' && peek_byte(stack) === 'T') {
+        stack.pos++;
+        const count = scan_varint(stack);
+        const size = scan_varint(stack);
+        stack.pos += count * size;
+    }
+    const result = magic === 'PASSNOT2' ? unpack_node_v2(stack) : unpack_node(stack, {});
     if (stack.pos + 8 > stack.array.length ||
         stack.array[stack.pos] !== 0 || 
         stack.array[stack.pos+1] !== 0 || 
@@ -135,7 +210,7 @@ function unpack_tree(stack) {
 }
 
 function main() {
-    console.log('PassNote -> Json Converter - ver 1.0.01');
+    console.log('PassNote -> Json Converter - ver 1.0.03');
     if (process.argv.length < 4) {
         console.log('usage pn2json input-file output-file');
         process.exit(1);
@@ -5,7 +5,13 @@
 #include "storage.h"
 #include "util.h"
 #include <lz4.h>
+#include <lz4frame.h>
+#include <zstd.h>
+#include <pthread.h>
 #include <mbedtls/aes.h>
+#include <mbedtls/chachapoly.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/hkdf.h>
 #include <mbedtls/sha256.h>
 #include <mbedtls/pkcs5.h>
 
@@ -13,42 +19,131 @@
 #define AES256_KEYLEN_BITS (AES256_KEYLEN*8)
 #define AES256_BLOCKLEN 16
 #define SHA256_BLOCKLEN 32
-#define DERIVE_N_ROUNDS 50000
-
-static int pbkdf2_sha256_derive_key ( const char *password, const uint8_t * salt, size_t salt_len,
-    uint8_t * key, size_t key_size )
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+#define SEGMENT_LOG2 20
+#define SEGMENT_MIN_LOG2 12
+#define SEGMENT_MAX_LOG2 30
+#define CHUNK_SIZE 65536
+#define WINDOW_SIZE 8388608
+#define LZ4F_FRAME_MAGIC { 0x04, 0x22, 0x4d, 0x18 }
+#define LZ4F_FRAME_MAGIC_SIZE 4
+#define CONTAINER_MAGIC { 'P', 'N', 'C', 'R', 'Y', 'P', 'T', '\0' }
+#define CONTAINER_MAGIC_SIZE 8
+#define CONTAINER_VERSION 4
+#define CONTAINER_HEADER_SIZE_V2 32
+#define CONTAINER_HEADER_SIZE_V3 64
+#define CONTAINER_HEADER_SIZE 72
+#define CONTAINER_NONCE_SIZE 32
+#define FILE_KEYS_INFO "passnote file keys"
+#define DEFAULT_UNLOCK_MS 250
+#define ZSTD_DICTIONARY_ID 1
+#define LZ4HC_MIN_LEVEL 3
+#define DEFAULT_STORAGE_OPTIONS \
+    { KDF_PBKDF2_SHA256, 0, CIPHER_AES256_CBC, CODEC_LZ4, 0, FALSE }
+
+/*
+ * Container header, all integers little endian:
+ *   0  magic[8]
+ *   8  version
+ *   9  kdf id, zero is PBKDF2-SHA256
+ *  10  cipher id, zero is AES-256-CBC with HMAC-SHA256
+ *  11  log2 of the AEAD segment size, zero for a single segment
+ *  12  kdf cost: PBKDF2 rounds (zero means 50000), or scrypt log2 N, r, p
+ *  16  plaintext length (packed tree size)
+ *  24  compressed length (before cipher padding)
+ *  32  nonce[32] for the per-file subkeys, version 3 onwards
+ *  64  codec id, zero is an LZ4 frame, version 4 onwards
+ *  65  codec dictionary id, zero for none
+ *  66  reserved[6], must be zero
+ * Followed by salt, hmac, iv and encrypted body as in the legacy format.
+ * AEAD ciphers keep their tag in the hmac slot and their nonce in the iv
+ * slot, zero padded, and authenticate header and iv as associated data.
+ * Segmented AEAD bodies are split into fixed-size segments, each sealed
+ * with the iv nonce xor its index; their tags form an index table between
+ * the iv and the body, so any segment can be opened on its own.
+ * Version 3 bodies are always LZ4 frames.
+ * Version 2 uses the PBKDF2 output directly as cipher and HMAC key.
+ * Legacy files carry no header and store the padding in the salt nibble.
+ */
+struct container_header_t
 {
-    mbedtls_md_context_t sha256_ctx;
-    const mbedtls_md_info_t *sha256_info;
-
-    mbedtls_md_init ( &sha256_ctx );
-
-    if ( !( sha256_info = mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ) ) )
-    {
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
-
-    if ( mbedtls_md_setup ( &sha256_ctx, sha256_info, TRUE ) != 0 )
-    {
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
-
-    if ( mbedtls_pkcs5_pbkdf2_hmac ( &sha256_ctx, ( const uint8_t * ) password,
-            strlen ( password ), salt, salt_len, DERIVE_N_ROUNDS, key_size, key ) != 0 )
-    {
-        memset ( key, '\0', key_size );
-        mbedtls_md_free ( &sha256_ctx );
-        return -1;
-    }
-
-    mbedtls_md_free ( &sha256_ctx );
-    return 0;
-}
-
-static int hmac_sha256 ( const uint8_t * key, size_t key_len, const uint8_t * input, size_t length,
-    uint8_t * hash )
+    int version;
+    size_t size;
+    struct kdf_params_t kdf;
+    int cipher;
+    int segment_log2;
+    int codec;
+    int dictionary;
+    uint64_t plaintext_len;
+    uint64_t compressed_len;
+    uint8_t nonce[CONTAINER_NONCE_SIZE];
+};
+
+/*
+ * The PBKDF2 output of the unlocked session, kept in locked memory so that
+ * saves and reloads with the same salt skip the key stretching. The epoch
+ * moves on whenever the cache is forgotten, a save queued before that must
+ * not bring the key back when it completes. The password itself is never
+ * kept, only an HMAC of it under the master key to tell whether it matches.
+ */
+struct key_cache_t
+{
+    uint8_t check[SHA256_BLOCKLEN];
+    struct kdf_params_t kdf;
+    uint8_t salt[AES256_KEYLEN];
+    uint8_t master[AES256_KEYLEN];
+};
+
+static struct key_cache_t *key_cache = NULL;
+static unsigned int key_cache_epoch = 0;
+static pthread_mutex_t key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Raw content dictionary for zstd, seeded with the field names, markers and
+ * URL fragments every vault repeats. Files record its id, so it must never
+ * change; a new dictionary needs a new id.
+ */
+static const uint8_t zstd_dictionary[] =
+    "e-Trash\0h+Web\0h+Mail\0h+Bank\0h+Social\0h+Work\0h+Games\0h+Shopping\0"
+    "Question\0Answer\0Birthday\0Recovery\0Location\0Address\0Phone\0Proxy\0"
+    "Session\0Domain\0Token\0Secret\0Name\0Notes\0Login\0PIN\0"
+    "http://\0https://\0https://www.\0.com/\0.org/\0.net/\0/login\0/signin\0"
+    "@gmail.com\0@outlook.com\0@yahoo.com\0@proton.me\0@icloud.com\0"
+    "\0f+6\0URL\0https://\0f+6\0Email\0\0f+6\0Username\0\0f-6\0Password\0\0l+";
+
+/* CBC stays the default, older builds read nothing else */
+static struct storage_options_t storage_options = DEFAULT_STORAGE_OPTIONS;
+static struct kdf_params_t calibrated_kdf;
+static int kdf_calibrated = FALSE;
+static pthread_mutex_t options_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct load_stream_t
+{
+    int cipher;
+    const uint8_t *src;
+    uint8_t *body;
+    size_t body_len;
+    struct segment_job_t *segments;
+    size_t window;
+    size_t encrypted_left;
+    size_t compressed_left;
+    mbedtls_aes_context aes;
+    uint8_t iv[AES256_BLOCKLEN];
+    int check_plaintext;
+    uint64_t plaintext_left;
+    LZ4F_dctx *lz4;
+    ZSTD_DCtx *zstd;
+    uint8_t *chunk;
+    size_t chunk_alloc;
+    size_t chunk_size;
+    size_t chunk_off;
+    size_t chunk_len;
+    int finished;
+};
+
+static int hmac_sha256 ( const uint8_t * key, size_t key_len, const uint8_t * prefix,
+    size_t prefix_len, const uint8_t * input, size_t length, uint8_t * hash )
 {
     mbedtls_md_context_t md_ctx;
     mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
@@ -57,6 +152,7 @@ static int hmac_sha256 ( const uint8_t * key, size_t key_len, const uint8_t * in
 
     if ( mbedtls_md_setup ( &md_ctx, mbedtls_md_info_from_type ( md_type ), TRUE ) != 0
         || mbedtls_md_hmac_starts ( &md_ctx, key, key_len ) != 0
+        || mbedtls_md_hmac_update ( &md_ctx, prefix, prefix_len ) != 0
         || mbedtls_md_hmac_update ( &md_ctx, input, length ) != 0
         || mbedtls_md_hmac_finish ( &md_ctx, hash ) != 0 )
     {
@@ -68,219 +164,1288 @@ static int hmac_sha256 ( const uint8_t * key, size_t key_len, const uint8_t * in
     return 0;
 }
 
-static int aes256_cbc_encrypt ( const uint8_t * key, const uint8_t * iv, size_t len,
-    const uint8_t * src, uint8_t * dst )
+static int aes256_cbc_encrypt_then_mac ( const uint8_t * key, const uint8_t * mac_key,
+    const uint8_t * iv, const uint8_t * prefix, size_t prefix_len, uint8_t * mem, size_t len,
+    uint8_t * hash )
 {
     int ret = 0;
+    size_t off;
+    size_t chunk_len;
     mbedtls_aes_context aes;
+    mbedtls_md_context_t md_ctx;
     uint8_t iv_workbuf[AES256_BLOCKLEN];
 
     mbedtls_aes_init ( &aes );
+    mbedtls_md_init ( &md_ctx );
     memcpy ( iv_workbuf, iv, AES256_BLOCKLEN );
 
     if ( mbedtls_aes_setkey_enc ( &aes, key, AES256_KEYLEN_BITS ) != 0
-        || mbedtls_aes_crypt_cbc ( &aes, MBEDTLS_AES_ENCRYPT, len, iv_workbuf, src, dst ) != 0 )
+        || mbedtls_md_setup ( &md_ctx, mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ),
+            TRUE ) != 0 || mbedtls_md_hmac_starts ( &md_ctx, mac_key, AES256_KEYLEN ) != 0
+        || mbedtls_md_hmac_update ( &md_ctx, prefix, prefix_len ) != 0 )
     {
         ret = -1;
     }
 
+    /* Encrypt in place and authenticate each chunk while it is still in cache */
+    for ( off = 0; !ret && off < len; off += chunk_len )
+    {
+        chunk_len = len - off < CHUNK_SIZE ? len - off : CHUNK_SIZE;
+
+        if ( mbedtls_aes_crypt_cbc ( &aes, MBEDTLS_AES_ENCRYPT, chunk_len, iv_workbuf,
+                mem + off, mem + off ) != 0
+            || mbedtls_md_hmac_update ( &md_ctx, mem + off, chunk_len ) != 0 )
+        {
+            ret = -1;
+        }
+    }
+
+    if ( !ret && mbedtls_md_hmac_finish ( &md_ctx, hash ) != 0 )
+    {
+        ret = -1;
+    }
+
+    mbedtls_md_free ( &md_ctx );
     mbedtls_aes_free ( &aes );
     memset ( &aes, '\0', sizeof ( aes ) );
 
-    return ret;
+    return ret;
+}
+
+static int aead_encrypt ( int cipher, const uint8_t * key, const uint8_t * nonce,
+    const uint8_t * aad, size_t aad_len, uint8_t * mem, size_t len, uint8_t * tag )
+{
+    int ret = 0;
+    mbedtls_gcm_context gcm;
+    mbedtls_chachapoly_context chachapoly;
+
+    if ( cipher == CIPHER_AES256_GCM )
+    {
+        mbedtls_gcm_init ( &gcm );
+
+        if ( mbedtls_gcm_setkey ( &gcm, MBEDTLS_CIPHER_ID_AES, key, AES256_KEYLEN_BITS ) != 0
+            || mbedtls_gcm_crypt_and_tag ( &gcm, MBEDTLS_GCM_ENCRYPT, len, nonce,
+                AEAD_NONCE_LEN, aad, aad_len, mem, mem, AEAD_TAG_LEN, tag ) != 0 )
+        {
+            ret = -1;
+        }
+
+        mbedtls_gcm_free ( &gcm );
+        return ret;
+    }
+
+    mbedtls_chachapoly_init ( &chachapoly );
+
+    if ( mbedtls_chachapoly_setkey ( &chachapoly, key ) != 0
+        || mbedtls_chachapoly_encrypt_and_tag ( &chachapoly, len, nonce, aad, aad_len, mem, mem,
+            tag ) != 0 )
+    {
+        ret = -1;
+    }
+
+    mbedtls_chachapoly_free ( &chachapoly );
+    return ret;
+}
+
+static int aead_decrypt ( int cipher, const uint8_t * key, const uint8_t * nonce,
+    const uint8_t * aad, size_t aad_len, const uint8_t * tag, const uint8_t * src, uint8_t * dst,
+    size_t len )
+{
+    int ret = 0;
+    mbedtls_gcm_context gcm;
+    mbedtls_chachapoly_context chachapoly;
+
+    if ( cipher == CIPHER_AES256_GCM )
+    {
+        mbedtls_gcm_init ( &gcm );
+
+        if ( mbedtls_gcm_setkey ( &gcm, MBEDTLS_CIPHER_ID_AES, key, AES256_KEYLEN_BITS ) != 0
+            || mbedtls_gcm_auth_decrypt ( &gcm, len, nonce, AEAD_NONCE_LEN, aad, aad_len, tag,
+                AEAD_TAG_LEN, src, dst ) != 0 )
+        {
+            ret = -1;
+        }
+
+        mbedtls_gcm_free ( &gcm );
+        return ret;
+    }
+
+    mbedtls_chachapoly_init ( &chachapoly );
+
+    if ( mbedtls_chachapoly_setkey ( &chachapoly, key ) != 0
+        || mbedtls_chachapoly_auth_decrypt ( &chachapoly, len, nonce, aad, aad_len, tag, src,
+            dst ) != 0 )
+    {
+        ret = -1;
+    }
+
+    mbedtls_chachapoly_free ( &chachapoly );
+    return ret;
+}
+
+struct segment_job_t
+{
+    int cipher;
+    const uint8_t *key;
+    const uint8_t *iv;
+    const uint8_t *aad;
+    size_t aad_len;
+    uint8_t *tags;
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t len;
+    size_t segment_size;
+    size_t first;
+};
+
+static size_t segment_count ( size_t len, int segment_log2 )
+{
+    return ( len + ( ( size_t ) 1 << segment_log2 ) - 1 ) >> segment_log2;
+}
+
+static void segment_nonce ( const uint8_t * iv, size_t index, uint8_t * nonce )
+{
+    memcpy ( nonce, iv, AEAD_NONCE_LEN );
+    nonce[AEAD_NONCE_LEN - 4] ^= ( index >> 24 ) & 0xff;
+    nonce[AEAD_NONCE_LEN - 3] ^= ( index >> 16 ) & 0xff;
+    nonce[AEAD_NONCE_LEN - 2] ^= ( index >> 8 ) & 0xff;
+    nonce[AEAD_NONCE_LEN - 1] ^= index & 0xff;
+}
+
+static int encrypt_segment ( void *ctx, size_t index )
+{
+    size_t off;
+    size_t len;
+    uint8_t nonce[AEAD_NONCE_LEN];
+    struct segment_job_t *job = ( struct segment_job_t * ) ctx;
+
+    off = index * job->segment_size;
+    len = job->len - off < job->segment_size ? job->len - off : job->segment_size;
+    segment_nonce ( job->iv, index, nonce );
+
+    return aead_encrypt ( job->cipher, job->key, nonce, job->aad, job->aad_len, job->dst + off,
+        len, job->tags + index * AEAD_TAG_LEN );
+}
+
+/* Opens segment first + index into slot index of the destination window */
+static int decrypt_segment ( void *ctx, size_t index )
+{
+    size_t off;
+    size_t len;
+    uint8_t nonce[AEAD_NONCE_LEN];
+    struct segment_job_t *job = ( struct segment_job_t * ) ctx;
+
+    off = ( job->first + index ) * job->segment_size;
+    len = job->len - off < job->segment_size ? job->len - off : job->segment_size;
+    segment_nonce ( job->iv, job->first + index, nonce );
+
+    return aead_decrypt ( job->cipher, job->key, nonce, job->aad, job->aad_len,
+        job->tags + ( job->first + index ) * AEAD_TAG_LEN, job->src + off,
+        job->dst + index * job->segment_size, len );
+}
+
+static int read_complete ( int fd, uint8_t * mem, size_t total )
+{
+    size_t len;
+    size_t sum;
+
+    for ( sum = 0; sum < total; sum += len )
+    {
+        if ( ( ssize_t ) ( len = read ( fd, mem + sum, total - sum ) ) <= 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int write_complete ( int fd, const uint8_t * mem, size_t total )
+{
+    size_t len;
+    size_t sum;
+
+    for ( sum = 0; sum < total; sum += len )
+    {
+        if ( ( ssize_t ) ( len = write ( fd, mem + sum, total - sum ) ) <= 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int writev_complete ( int fd, struct iovec *iov, int iovcnt )
+{
+    ssize_t len;
+
+    while ( iovcnt )
+    {
+        if ( ( len = writev ( fd, iov, iovcnt ) ) <= 0 )
+        {
+            return -1;
+        }
+
+        for ( ; iovcnt && ( size_t ) len >= iov->iov_len; iov++, iovcnt-- )
+        {
+            len -= iov->iov_len;
+        }
+
+        if ( iovcnt )
+        {
+            iov->iov_base = ( uint8_t * ) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+
+    return 0;
+}
+
+static int sync_parent_dir ( const char *path )
+{
+    int fd;
+    int ret;
+    char *ptr;
+    char dir_path[PATH_SIZE];
+
+    snprintf ( dir_path, sizeof ( dir_path ), "%s", path );
+
+    if ( ( ptr = strrchr ( dir_path, '/' ) ) )
+    {
+        ptr[ptr == dir_path] = '\0';
+
+    } else
+    {
+        strcpy ( dir_path, "." );
+    }
+
+    if ( ( fd = open ( dir_path, O_RDONLY | O_DIRECTORY ) ) < 0 )
+    {
+        return -1;
+    }
+
+    ret = fsync ( fd );
+    close ( fd );
+    return ret;
+}
+
+static void put_u32 ( uint8_t * mem, uint32_t value )
+{
+    size_t i;
+
+    for ( i = 0; i < sizeof ( uint32_t ); i++ )
+    {
+        mem[i] = ( value >> ( i * 8 ) ) & 0xff;
+    }
+}
+
+static uint32_t get_u32 ( const uint8_t * mem )
+{
+    size_t i;
+    uint32_t value = 0;
+
+    for ( i = 0; i < sizeof ( uint32_t ); i++ )
+    {
+        value |= ( ( uint32_t ) mem[i] ) << ( i * 8 );
+    }
+
+    return value;
+}
+
+static void put_u64 ( uint8_t * mem, uint64_t value )
+{
+    size_t i;
+
+    for ( i = 0; i < sizeof ( uint64_t ); i++ )
+    {
+        mem[i] = ( value >> ( i * 8 ) ) & 0xff;
+    }
+}
+
+static uint64_t get_u64 ( const uint8_t * mem )
+{
+    size_t i;
+    uint64_t value = 0;
+
+    for ( i = 0; i < sizeof ( uint64_t ); i++ )
+    {
+        value |= ( ( uint64_t ) mem[i] ) << ( i * 8 );
+    }
+
+    return value;
+}
+
+static void write_header ( const struct container_header_t *header, uint8_t * mem )
+{
+    uint8_t magic[CONTAINER_MAGIC_SIZE] = CONTAINER_MAGIC;
+
+    memset ( mem, '\0', CONTAINER_HEADER_SIZE );
+    memcpy ( mem, magic, CONTAINER_MAGIC_SIZE );
+    mem[8] = header->version;
+    mem[9] = header->kdf.id;
+    mem[10] = header->cipher;
+    mem[11] = header->segment_log2;
+
+    if ( header->kdf.id == KDF_SCRYPT )
+    {
+        mem[12] = header->kdf.log2_n;
+        mem[13] = header->kdf.r;
+        mem[14] = header->kdf.p;
+
+    } else
+    {
+        put_u32 ( mem + 12, header->kdf.rounds );
+    }
+
+    put_u64 ( mem + 16, header->plaintext_len );
+    put_u64 ( mem + 24, header->compressed_len );
+    memcpy ( mem + 32, header->nonce, CONTAINER_NONCE_SIZE );
+    mem[64] = header->codec;
+    mem[65] = header->dictionary;
+}
+
+static int has_container_magic ( const uint8_t * mem, size_t len )
+{
+    uint8_t magic[CONTAINER_MAGIC_SIZE] = CONTAINER_MAGIC;
+
+    return len >= CONTAINER_MAGIC_SIZE && !memcmp ( mem, magic, CONTAINER_MAGIC_SIZE );
+}
+
+static int parse_header ( const uint8_t * mem, size_t len, struct container_header_t *header )
+{
+    size_t i;
+
+    if ( len < CONTAINER_HEADER_SIZE_V2 || !has_container_magic ( mem, len ) )
+    {
+        return -1;
+    }
+
+    if ( mem[8] == 2 )
+    {
+        header->size = CONTAINER_HEADER_SIZE_V2;
+
+    } else if ( mem[8] == 3 )
+    {
+        header->size = CONTAINER_HEADER_SIZE_V3;
+
+    } else if ( mem[8] == CONTAINER_VERSION )
+    {
+        header->size = CONTAINER_HEADER_SIZE;
+
+    } else
+    {
+        return -1;
+    }
+
+    if ( len < header->size )
+    {
+        return -1;
+    }
+
+    for ( i = 9; header->size == CONTAINER_HEADER_SIZE_V2 && i < 12; i++ )
+    {
+        if ( mem[i] )
+        {
+            return -1;
+        }
+    }
+
+    for ( i = 66; header->size == CONTAINER_HEADER_SIZE && i < CONTAINER_HEADER_SIZE; i++ )
+    {
+        if ( mem[i] )
+        {
+            return -1;
+        }
+    }
+
+    kdf_default_params ( &header->kdf );
+
+    if ( ( header->kdf.id = mem[9] ) == KDF_SCRYPT )
+    {
+        header->kdf.log2_n = mem[12];
+        header->kdf.r = mem[13];
+        header->kdf.p = mem[14];
+
+    } else if ( get_u32 ( mem + 12 ) )
+    {
+        header->kdf.rounds = get_u32 ( mem + 12 );
+    }
+
+    if ( !kdf_params_valid ( &header->kdf ) || ( mem[8] == 2 && get_u32 ( mem + 12 ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( header->cipher = mem[10] ) > CIPHER_CHACHA20_POLY1305 )
+    {
+        return -1;
+    }
+
+    if ( ( header->segment_log2 = mem[11] ) && ( header->cipher == CIPHER_AES256_CBC
+            || header->segment_log2 < SEGMENT_MIN_LOG2
+            || header->segment_log2 > SEGMENT_MAX_LOG2 ) )
+    {
+        return -1;
+    }
+
+    header->codec = CODEC_LZ4;
+    header->dictionary = 0;
+
+    if ( header->size == CONTAINER_HEADER_SIZE )
+    {
+        header->codec = mem[64];
+        header->dictionary = mem[65];
+    }
+
+    if ( header->codec > CODEC_ZSTD || ( header->dictionary
+            && ( header->codec != CODEC_ZSTD || header->dictionary != ZSTD_DICTIONARY_ID ) ) )
+    {
+        return -1;
+    }
+
+    header->version = mem[8];
+    header->plaintext_len = get_u64 ( mem + 16 );
+    header->compressed_len = get_u64 ( mem + 24 );
+
+    /* With no segment to open nothing would check the header or the password */
+    if ( header->segment_log2 && !header->compressed_len )
+    {
+        return -1;
+    }
+
+    if ( header->version >= 3 )
+    {
+        memcpy ( header->nonce, mem + 32, CONTAINER_NONCE_SIZE );
+    }
+
+    return 0;
+}
+
+/* Compare digests in time independent of where they differ */
+static int digest_equal ( const uint8_t * a, const uint8_t * b, size_t len )
+{
+    size_t i;
+    uint8_t diff = 0;
+
+    for ( i = 0; i < len; i++ )
+    {
+        diff |= a[i] ^ b[i];
+    }
+
+    return !diff;
+}
+
+/* The cached entry only ever matches the password its master key came from */
+static int key_cache_matches ( const char *password )
+{
+    int ret;
+    uint8_t check[SHA256_BLOCKLEN];
+
+    ret = key_cache
+        && hmac_sha256 ( key_cache->master, AES256_KEYLEN, NULL, 0, ( const uint8_t * ) password,
+        strlen ( password ), check ) >= 0
+        && digest_equal ( check, key_cache->check, SHA256_BLOCKLEN );
+
+    memset ( check, '\0', sizeof ( check ) );
+    return ret;
+}
+
+static int lookup_master_key ( const char *password, const uint8_t * salt,
+    const struct kdf_params_t *kdf, uint8_t * master )
+{
+    int ret = -1;
+
+    pthread_mutex_lock ( &key_cache_mutex );
+
+    if ( key_cache_matches ( password )
+        && kdf_params_equal ( &key_cache->kdf, kdf )
+        && !memcmp ( key_cache->salt, salt, AES256_KEYLEN ) )
+    {
+        memcpy ( master, key_cache->master, AES256_KEYLEN );
+        ret = 0;
+    }
+
+    pthread_mutex_unlock ( &key_cache_mutex );
+    return ret;
+}
+
+static int lookup_cached_salt ( const char *password, uint8_t * salt,
+    struct kdf_params_t *kdf )
+{
+    int ret = -1;
+
+    pthread_mutex_lock ( &key_cache_mutex );
+
+    if ( key_cache_matches ( password ) )
+    {
+        memcpy ( salt, key_cache->salt, AES256_KEYLEN );
+        memcpy ( kdf, &key_cache->kdf, sizeof ( struct kdf_params_t ) );
+        ret = 0;
+    }
+
+    pthread_mutex_unlock ( &key_cache_mutex );
+    return ret;
+}
+
+static void store_master_key ( const char *password, const uint8_t * salt,
+    const struct kdf_params_t *kdf, const uint8_t * master, unsigned int epoch )
+{
+    pthread_mutex_lock ( &key_cache_mutex );
+
+    if ( epoch != key_cache_epoch )
+    {
+        /* Forgotten while the key was derived */
+    } else if ( key_cache
+        || ( key_cache =
+            ( struct key_cache_t * ) secure_alloc_locked ( sizeof ( struct key_cache_t ) ) ) )
+    {
+        memset ( key_cache, '\0', sizeof ( struct key_cache_t ) );
+        memcpy ( &key_cache->kdf, kdf, sizeof ( struct kdf_params_t ) );
+        memcpy ( key_cache->salt, salt, AES256_KEYLEN );
+        memcpy ( key_cache->master, master, AES256_KEYLEN );
+
+        if ( hmac_sha256 ( master, AES256_KEYLEN, NULL, 0, ( const uint8_t * ) password,
+                strlen ( password ), key_cache->check ) < 0 )
+        {
+            secure_free_locked ( key_cache, sizeof ( struct key_cache_t ) );
+            key_cache = NULL;
+        }
+    }
+
+    pthread_mutex_unlock ( &key_cache_mutex );
+}
+
+unsigned int get_key_cache_epoch ( void )
+{
+    unsigned int epoch;
+
+    pthread_mutex_lock ( &key_cache_mutex );
+    epoch = key_cache_epoch;
+    pthread_mutex_unlock ( &key_cache_mutex );
+    return epoch;
+}
+
+void forget_cached_keys ( void )
+{
+    pthread_mutex_lock ( &key_cache_mutex );
+    key_cache_epoch++;
+
+    if ( key_cache )
+    {
+        secure_free_locked ( key_cache, sizeof ( struct key_cache_t ) );
+        key_cache = NULL;
+    }
+
+    pthread_mutex_unlock ( &key_cache_mutex );
+}
+
+void storage_default_options ( struct storage_options_t *options )
+{
+    const struct storage_options_t defaults = DEFAULT_STORAGE_OPTIONS;
+
+    memcpy ( options, &defaults, sizeof ( struct storage_options_t ) );
+}
+
+void set_storage_options ( const struct storage_options_t *options )
+{
+    pthread_mutex_lock ( &options_mutex );
+    memcpy ( &storage_options, options, sizeof ( struct storage_options_t ) );
+    kdf_calibrated = FALSE;
+    pthread_mutex_unlock ( &options_mutex );
+}
+
+static int get_save_cipher ( void )
+{
+    int cipher;
+
+    pthread_mutex_lock ( &options_mutex );
+    cipher = storage_options.cipher;
+    pthread_mutex_unlock ( &options_mutex );
+    return cipher;
+}
+
+/*
+ * LZ4 HC writes the same frames as LZ4, only the frame level tells them
+ * apart. Each codec keeps to its own level range whatever was asked for.
+ */
+static int get_save_codec ( int *level )
+{
+    int codec;
+
+    pthread_mutex_lock ( &options_mutex );
+    codec = storage_options.codec;
+    *level = storage_options.level;
+    pthread_mutex_unlock ( &options_mutex );
+
+    if ( codec == CODEC_LZ4HC )
+    {
+        *level = !*level ? CODEC_LZ4HC_LEVEL : *level < LZ4HC_MIN_LEVEL ? LZ4HC_MIN_LEVEL
+            : *level;
+        return CODEC_LZ4;
+    }
+
+    if ( codec == CODEC_LZ4 && *level > 0 )
+    {
+        *level = 0;
+    }
+
+    return codec;
+}
+
+static int get_zero_copy ( void )
+{
+    int zero_copy;
+
+    pthread_mutex_lock ( &options_mutex );
+    zero_copy = storage_options.zero_copy;
+    pthread_mutex_unlock ( &options_mutex );
+    return zero_copy;
+}
+
+static int get_save_kdf_params ( struct kdf_params_t *kdf )
+{
+    int ret = 0;
+
+    pthread_mutex_lock ( &options_mutex );
+
+    if ( !storage_options.unlock_ms && storage_options.kdf == KDF_PBKDF2_SHA256 )
+    {
+        kdf_default_params ( kdf );
+
+    } else
+    {
+        /* Measured once per process, the machine does not get faster */
+        if ( !kdf_calibrated )
+        {
+            if ( kdf_calibrate ( storage_options.kdf, storage_options.unlock_ms
+                    ? storage_options.unlock_ms : DEFAULT_UNLOCK_MS, &calibrated_kdf ) >= 0 )
+            {
+                kdf_calibrated = TRUE;
+            } else
+            {
+                ret = -1;
+            }
+        }
+
+        memcpy ( kdf, &calibrated_kdf, sizeof ( struct kdf_params_t ) );
+    }
+
+    pthread_mutex_unlock ( &options_mutex );
+    return ret;
+}
+
+static int derive_file_keys ( const char *password, const uint8_t * salt,
+    const struct container_header_t *header, uint8_t * master, uint8_t * enc_key,
+    uint8_t * mac_key )
+{
+    uint8_t keys[AES256_KEYLEN * 2];
+
+    if ( lookup_master_key ( password, salt, &header->kdf, master ) < 0
+        && kdf_derive_key ( password, salt, AES256_KEYLEN, &header->kdf, master,
+            AES256_KEYLEN ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( header->version < 3 )
+    {
+        memcpy ( enc_key, master, AES256_KEYLEN );
+        memcpy ( mac_key, master, AES256_KEYLEN );
+        return 0;
+    }
+
+    /* Cheap per-file subkeys, the nonce is fresh on every save */
+    if ( mbedtls_hkdf ( mbedtls_md_info_from_type ( MBEDTLS_MD_SHA256 ), header->nonce,
+            CONTAINER_NONCE_SIZE, master, AES256_KEYLEN,
+            ( const uint8_t * ) FILE_KEYS_INFO, strlen ( FILE_KEYS_INFO ), keys,
+            sizeof ( keys ) ) != 0 )
+    {
+        memset ( master, '\0', AES256_KEYLEN );
+        return -1;
+    }
+
+    memcpy ( enc_key, keys, AES256_KEYLEN );
+    memcpy ( mac_key, keys + AES256_KEYLEN, AES256_KEYLEN );
+    memset ( keys, '\0', sizeof ( keys ) );
+    return 0;
+}
+
+static uint8_t *read_file_in ( int fd, size_t *len, int *mapped )
+{
+    ssize_t ret;
+    size_t size;
+    uint8_t *mem;
+    uint8_t *mem_backup;
+    struct stat st;
+
+    if ( fstat ( fd, &st ) >= 0 && S_ISREG ( st.st_mode ) && st.st_size > 0 )
+    {
+        if ( ( mem = ( uint8_t * ) mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                    0 ) ) != MAP_FAILED )
+        {
+            madvise ( mem, st.st_size, MADV_SEQUENTIAL );
+            *len = st.st_size;
+            *mapped = TRUE;
+            return mem;
+        }
+    }
+
+    /* Pipes and special files cannot be mapped, read them until end of file */
+    size = CHUNK_SIZE;
+    *len = 0;
+    *mapped = FALSE;
+
+    if ( !( mem = ( uint8_t * ) malloc ( size ) ) )
+    {
+        return NULL;
+    }
+
+    while ( ( ret = read ( fd, mem + *len, size - *len ) ) > 0 )
+    {
+        if ( ( *len += ret ) < size )
+        {
+            continue;
+        }
+
+        mem_backup = mem;
+
+        if ( !( mem = ( uint8_t * ) malloc ( size << 1 ) ) )
+        {
+            secure_free_mem ( mem_backup, size );
+            return NULL;
+        }
+
+        memcpy ( mem, mem_backup, size );
+        secure_free_mem ( mem_backup, size );
+        size <<= 1;
+    }
+
+    if ( ret < 0 )
+    {
+        secure_free_mem ( mem, size );
+        return NULL;
+    }
+
+    return mem;
+}
+
+static void release_file_in ( uint8_t * mem, size_t len, int mapped )
+{
+    /* Mapped pages are read-only file cache, there is nothing of ours to wipe */
+    if ( mapped )
+    {
+        munmap ( mem, len );
+
+    } else
+    {
+        secure_free_mem ( mem, len );
+    }
+}
+
+static int load_stream_decrypt ( struct load_stream_t *stream, uint8_t * mem, size_t len )
+{
+    if ( len > stream->encrypted_left )
+    {
+        return -1;
+    }
+
+    /* AEAD bodies are authenticated and decrypted up front */
+    if ( stream->cipher != CIPHER_AES256_CBC )
+    {
+        memcpy ( mem, stream->src, len );
+
+    } else if ( mbedtls_aes_crypt_cbc ( &stream->aes, MBEDTLS_AES_DECRYPT, len, stream->iv,
+            stream->src, mem ) != 0 )
+    {
+        return -1;
+    }
+
+    stream->src += len;
+    stream->encrypted_left -= len;
+    return 0;
 }
 
-static int aes256_cbc_decrypt ( const uint8_t * key, const uint8_t * iv, size_t len,
-    const uint8_t * src, uint8_t * dst )
+/*
+ * Segmented AEAD bodies are opened a window at a time, the segments of a
+ * window in parallel. Each one is authenticated before its plaintext is
+ * handed on, and their count is fixed by the authenticated header.
+ */
+static int load_stream_open_segments ( struct load_stream_t *stream, size_t *len )
 {
-    int ret = 0;
-    mbedtls_aes_context aes;
-    uint8_t iv_workbuf[AES256_BLOCKLEN];
+    size_t count;
+    struct segment_job_t *job = stream->segments;
 
-    mbedtls_aes_init ( &aes );
-    memcpy ( iv_workbuf, iv, AES256_BLOCKLEN );
+    count = ( stream->encrypted_left + job->segment_size - 1 ) / job->segment_size;
+    count = count < stream->window ? count : stream->window;
+    *len = count * job->segment_size < stream->encrypted_left ? count * job->segment_size
+        : stream->encrypted_left;
+    job->dst = stream->chunk;
 
-    if ( mbedtls_aes_setkey_dec ( &aes, key, AES256_KEYLEN_BITS ) != 0
-        || mbedtls_aes_crypt_cbc ( &aes, MBEDTLS_AES_DECRYPT, len, iv_workbuf, src, dst ) != 0 )
+    if ( parallel_run ( count, decrypt_segment, job ) < 0 )
     {
-        ret = -1;
+        return -1;
     }
 
-    mbedtls_aes_free ( &aes );
-    memset ( &aes, '\0', sizeof ( aes ) );
-
-    return ret;
+    job->first += count;
+    stream->encrypted_left -= *len;
+    return 0;
 }
 
-static int read_complete ( int fd, uint8_t * mem, size_t total )
+static int load_stream_next_chunk ( struct load_stream_t *stream )
 {
     size_t len;
-    size_t sum;
 
-    for ( sum = 0; sum < total; sum += len )
+    if ( stream->segments )
     {
-        if ( ( ssize_t ) ( len = read ( fd, mem + sum, total - sum ) ) <= 0 )
+        if ( load_stream_open_segments ( stream, &len ) < 0 )
+        {
+            return -1;
+        }
+
+    } else
+    {
+        len = stream->encrypted_left < CHUNK_SIZE ? stream->encrypted_left : CHUNK_SIZE;
+
+        if ( load_stream_decrypt ( stream, stream->chunk, len ) < 0 )
         {
             return -1;
         }
     }
 
+    stream->chunk_size = len;
+    stream->chunk_off = 0;
+    stream->chunk_len = len < stream->compressed_left ? len : stream->compressed_left;
+    stream->compressed_left -= stream->chunk_len;
     return 0;
 }
 
-static int write_complete ( int fd, const uint8_t * mem, size_t total )
+static ssize_t load_stream_read ( void *ctx, uint8_t * mem, size_t len )
 {
-    size_t len;
-    size_t sum;
-
-    for ( sum = 0; sum < total; sum += len )
+    size_t ret;
+    size_t src_len;
+    size_t dst_len;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    struct load_stream_t *stream = ( struct load_stream_t * ) ctx;
+
+    while ( !stream->finished )
     {
-        if ( ( ssize_t ) ( len = write ( fd, mem + sum, total - sum ) ) <= 0 )
+        if ( stream->chunk_off == stream->chunk_len )
         {
+            if ( !stream->compressed_left )
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            if ( load_stream_next_chunk ( stream ) < 0 )
+            {
+                return -1;
+            }
+        }
+
+        src_len = stream->chunk_len - stream->chunk_off;
+        dst_len = len;
+
+        if ( stream->zstd )
+        {
+            in.src = stream->chunk + stream->chunk_off;
+            in.size = src_len;
+            in.pos = 0;
+            out.dst = mem;
+            out.size = dst_len;
+            out.pos = 0;
+
+            if ( ZSTD_isError ( ret = ZSTD_decompressStream ( stream->zstd, &out, &in ) ) )
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            src_len = in.pos;
+            dst_len = out.pos;
+
+        } else if ( LZ4F_isError ( ret = LZ4F_decompress ( stream->lz4, mem, &dst_len,
+                    stream->chunk + stream->chunk_off, &src_len, NULL ) ) )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        stream->chunk_off += src_len;
+        stream->finished = !ret;
+
+        /* Trailing segments would never be opened, and so never authenticated */
+        if ( stream->finished && stream->segments
+            && ( stream->chunk_off != stream->chunk_len || stream->compressed_left ) )
+        {
+            errno = EINVAL;
             return -1;
         }
+
+        if ( stream->check_plaintext )
+        {
+            if ( dst_len > stream->plaintext_left
+                || ( stream->finished && stream->plaintext_left != dst_len ) )
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            stream->plaintext_left -= dst_len;
+        }
+
+        if ( dst_len )
+        {
+            return dst_len;
+        }
     }
 
     return 0;
 }
 
-static struct node_t *load_database_in ( int fd, const char *password )
+static struct node_t *load_legacy_body ( struct load_stream_t *stream )
 {
-    size_t plaintext_size;
-    size_t plaintext_len;
+    size_t compressed_size;
     size_t compressed_len;
-    size_t encrypted_len;
-    uint8_t *plaintext;
+    size_t plaintext_size;
+    ssize_t plaintext_len;
     uint8_t *compressed;
-    uint8_t *encrypted;
+    uint8_t *plaintext;
     struct node_t *result;
-    uint8_t salt[AES256_KEYLEN];
-    uint8_t key[AES256_KEYLEN];
-    uint8_t iv[AES256_BLOCKLEN];
-    uint8_t hmac[SHA256_BLOCKLEN];
-    uint8_t hmac_calc[SHA256_BLOCKLEN];
 
-    if ( ( off_t ) ( encrypted_len = lseek ( fd, 0, SEEK_END ) ) < 0 )
+    compressed_size = stream->chunk_size + stream->encrypted_left;
+    compressed_len = stream->chunk_len + stream->compressed_left;
+
+    if ( !( compressed = ( uint8_t * ) malloc ( compressed_size ) ) )
     {
         return NULL;
     }
 
-    if ( lseek ( fd, 0, SEEK_SET ) < 0 )
+    memcpy ( compressed, stream->chunk, stream->chunk_size );
+
+    if ( load_stream_decrypt ( stream, compressed + stream->chunk_size,
+            stream->encrypted_left ) < 0 )
+    {
+        secure_free_mem ( compressed, compressed_size );
+        return NULL;
+    }
+
+    plaintext_size = compressed_size * 8;
+
+    if ( !( plaintext = ( uint8_t * ) malloc ( plaintext_size ) ) )
     {
+        secure_free_mem ( compressed, compressed_size );
         return NULL;
     }
 
-    if ( !password )
+    if ( ( plaintext_len =
+            LZ4_decompress_safe ( ( char * ) compressed, ( char * ) plaintext, compressed_len,
+                plaintext_size ) ) < 0 )
     {
-        if ( !( encrypted = ( uint8_t * ) malloc ( encrypted_len ) ) )
+        secure_free_mem ( plaintext, plaintext_size );
+
+        plaintext_size = compressed_size * 255;
+
+        if ( !( plaintext = ( uint8_t * ) malloc ( plaintext_size ) ) )
         {
+            secure_free_mem ( compressed, compressed_size );
             return NULL;
         }
 
-        if ( read_complete ( fd, encrypted, encrypted_len ) < 0 )
+        if ( ( plaintext_len =
+                LZ4_decompress_safe ( ( char * ) compressed, ( char * ) plaintext,
+                    compressed_len, plaintext_size ) ) < 0 )
         {
-            secure_free_mem ( encrypted, encrypted_len );
+            secure_free_mem ( compressed, compressed_size );
+            secure_free_mem ( plaintext, plaintext_size );
             return NULL;
         }
+    }
+
+    secure_free_mem ( compressed, compressed_size );
 
-        result = unpack_tree ( encrypted, encrypted_len );
-        secure_free_mem ( encrypted, encrypted_len );
-        return result;
+    result = unpack_tree ( plaintext, plaintext_len );
+    secure_free_mem ( plaintext, plaintext_size );
+
+    return result;
+}
+
+static struct node_t *unpack_load_stream ( struct load_stream_t *stream,
+    const struct container_header_t *header )
+{
+    /* The plaintext size must be known to keep it as one backing buffer */
+    if ( stream->check_plaintext && header->plaintext_len <= SIZE_MAX && get_zero_copy (  ) )
+    {
+        return unpack_tree_view ( load_stream_read, stream, header->plaintext_len );
     }
 
-    if ( encrypted_len < sizeof ( salt ) + sizeof ( hmac ) + sizeof ( iv ) + AES256_BLOCKLEN )
+    return unpack_tree_stream ( load_stream_read, stream );
+}
+
+static void free_load_stream ( struct load_stream_t *stream )
+{
+    if ( stream->lz4 )
     {
-        return NULL;
+        LZ4F_freeDecompressionContext ( stream->lz4 );
     }
 
-    encrypted_len -= sizeof ( salt ) + sizeof ( hmac ) + sizeof ( iv );
+    if ( stream->zstd )
+    {
+        ZSTD_freeDCtx ( stream->zstd );
+    }
 
-    if ( encrypted_len % AES256_BLOCKLEN
-        || !( encrypted = ( uint8_t * ) malloc ( encrypted_len ) ) )
+    if ( stream->chunk )
     {
-        return NULL;
+        secure_free_mem ( stream->chunk, stream->chunk_alloc );
+    }
+
+    if ( stream->body )
+    {
+        secure_free_mem ( stream->body, stream->body_len );
+    }
+
+    mbedtls_aes_free ( &stream->aes );
+    memset ( stream, '\0', sizeof ( struct load_stream_t ) );
+}
+
+static struct node_t *load_database_in ( const uint8_t * mem, size_t len, const char *password )
+{
+    size_t encrypted_len;
+    size_t prefix_len = 0;
+    struct node_t *result;
+    struct container_header_t header = { 0 };
+    struct load_stream_t stream = { 0 };
+    uint8_t frame_magic[LZ4F_FRAME_MAGIC_SIZE] = LZ4F_FRAME_MAGIC;
+    uint8_t prefix[CONTAINER_HEADER_SIZE + AES256_BLOCKLEN];
+    const uint8_t *salt;
+    const uint8_t *hmac;
+    const uint8_t *iv;
+    uint8_t master[AES256_KEYLEN];
+    uint8_t key[AES256_KEYLEN];
+    uint8_t mac_key[AES256_KEYLEN];
+    uint8_t hmac_calc[SHA256_BLOCKLEN];
+    size_t tags_len;
+    unsigned int key_epoch;
+    struct segment_job_t segments = { 0 };
+
+    if ( !password )
+    {
+        return unpack_tree ( mem, len );
     }
 
-    if ( !( compressed = ( uint8_t * ) malloc ( encrypted_len ) ) )
+    key_epoch = get_key_cache_epoch (  );
+    stream.chunk_alloc = CHUNK_SIZE;
+    mbedtls_aes_init ( &stream.aes );
+
+    if ( parse_header ( mem, len, &header ) >= 0 )
+    {
+        prefix_len = header.size;
+
+    } else if ( has_container_magic ( mem, len ) )
     {
-        free ( encrypted );
+        /* Unknown versions or a key derivation cost out of bounds */
+        errno = EINVAL;
         return NULL;
+
+    } else
+    {
+        header.version = 0;
+        header.cipher = CIPHER_AES256_CBC;
+        header.codec = CODEC_LZ4;
+        kdf_default_params ( &header.kdf );
     }
 
-    if ( read_complete ( fd, salt, sizeof ( salt ) ) < 0
-        || read_complete ( fd, hmac, sizeof ( hmac ) ) < 0
-        || read_complete ( fd, iv, sizeof ( iv ) ) < 0
-        || pbkdf2_sha256_derive_key ( password, salt, sizeof ( salt ), key, sizeof ( key ) ) < 0
-        || read_complete ( fd, encrypted, encrypted_len ) < 0
-        || hmac_sha256 ( key, sizeof ( key ), encrypted, encrypted_len, hmac_calc ) < 0
-        || memcmp ( hmac_calc, hmac, SHA256_BLOCKLEN ) )
+    if ( len < prefix_len + AES256_KEYLEN + SHA256_BLOCKLEN + AES256_BLOCKLEN * 2 )
     {
-        memset ( key, '\0', sizeof ( key ) );
-        free ( compressed );
-        free ( encrypted );
-        return 0;
+        return NULL;
     }
 
-    if ( aes256_cbc_decrypt ( key, iv, encrypted_len, encrypted, compressed ) < 0 )
+    salt = mem + prefix_len;
+    hmac = salt + AES256_KEYLEN;
+    iv = hmac + SHA256_BLOCKLEN;
+    stream.src = iv + AES256_BLOCKLEN;
+    encrypted_len = len - ( stream.src - mem );
+
+    if ( header.cipher == CIPHER_AES256_CBC && encrypted_len % AES256_BLOCKLEN )
     {
-        memset ( key, '\0', sizeof ( key ) );
-        free ( encrypted );
-        secure_free_mem ( compressed, encrypted_len );
         return NULL;
     }
 
-    memset ( key, '\0', sizeof ( key ) );
-    free ( encrypted );
+    if ( header.segment_log2 )
+    {
+        tags_len = segment_count ( header.compressed_len, header.segment_log2 ) * AEAD_TAG_LEN;
+
+        if ( header.compressed_len > encrypted_len || tags_len > encrypted_len )
+        {
+            errno = EINVAL;
+            return NULL;
+        }
 
-    compressed_len = encrypted_len;
+        segments.tags = ( uint8_t * ) stream.src;
+        stream.src += tags_len;
+        encrypted_len -= tags_len;
+    }
 
-    if ( salt[0] & 0xf0 )
+    if ( prefix_len && ( header.compressed_len > encrypted_len
+            || ( header.cipher == CIPHER_AES256_CBC
+                ? header.compressed_len + AES256_BLOCKLEN <= encrypted_len
+                : header.compressed_len != encrypted_len ) ) )
     {
-        compressed_len += ( ( salt[0] & 0xf0 ) >> 4 ) - AES256_BLOCKLEN;
+        errno = EINVAL;
+        return NULL;
     }
 
-    plaintext_size = encrypted_len * 8;
+    if ( prefix_len )
+    {
+        memcpy ( prefix, mem, prefix_len );
+        memcpy ( prefix + prefix_len, iv, AES256_BLOCKLEN );
+        prefix_len += AES256_BLOCKLEN;
+    }
 
-    if ( !( plaintext = ( uint8_t * ) malloc ( plaintext_size ) ) )
+    if ( derive_file_keys ( password, salt, &header, master, key, mac_key ) < 0 )
     {
-        secure_free_mem ( compressed, encrypted_len );
         return NULL;
     }
 
-    if ( ( ssize_t ) ( plaintext_len =
-            LZ4_decompress_safe ( ( char * ) compressed, ( char * ) plaintext, compressed_len,
-                plaintext_size ) ) < 0 )
+    if ( header.cipher == CIPHER_AES256_CBC )
     {
-        secure_free_mem ( plaintext, plaintext_len );
+        if ( hmac_sha256 ( mac_key, sizeof ( mac_key ), prefix, prefix_len, stream.src,
+                encrypted_len, hmac_calc ) < 0
+            || !digest_equal ( hmac_calc, hmac, SHA256_BLOCKLEN ) )
+        {
+            memset ( master, '\0', sizeof ( master ) );
+            memset ( key, '\0', sizeof ( key ) );
+            memset ( mac_key, '\0', sizeof ( mac_key ) );
+            return NULL;
+        }
 
-        plaintext_size = encrypted_len * 255;
+    } else if ( header.segment_log2 )
+    {
+        segments.cipher = header.cipher;
+        segments.key = key;
+        segments.iv = iv;
+        segments.aad = prefix;
+        segments.aad_len = prefix_len;
+        segments.src = stream.src;
+        segments.len = encrypted_len;
+        segments.segment_size = ( size_t ) 1 << header.segment_log2;
+        stream.segments = &segments;
+        stream.window = segments.segment_size < WINDOW_SIZE
+            ? WINDOW_SIZE / segments.segment_size : 1;
+        stream.chunk_alloc = stream.window * segments.segment_size;
+
+        if ( stream.chunk_alloc > encrypted_len )
+        {
+            stream.chunk_alloc = encrypted_len ? encrypted_len : 1;
+        }
 
-        if ( !( plaintext = ( uint8_t * ) malloc ( plaintext_size ) ) )
+    } else
+    {
+        /* A single segment is only authenticated as a whole */
+        if ( !( stream.body = ( uint8_t * ) malloc ( encrypted_len ? encrypted_len : 1 ) ) )
         {
-            secure_free_mem ( compressed, encrypted_len );
+            memset ( master, '\0', sizeof ( master ) );
+            memset ( key, '\0', sizeof ( key ) );
+            memset ( mac_key, '\0', sizeof ( mac_key ) );
             return NULL;
         }
 
-        if ( ( ssize_t ) ( plaintext_len =
-                LZ4_decompress_safe ( ( char * ) compressed, ( char * ) plaintext, compressed_len,
-                    plaintext_size ) ) < 0 )
+        stream.body_len = encrypted_len ? encrypted_len : 1;
+
+        if ( aead_decrypt ( header.cipher, key, iv, prefix, prefix_len, hmac, stream.src,
+                stream.body, encrypted_len ) < 0 )
         {
-            secure_free_mem ( compressed, encrypted_len );
-            secure_free_mem ( plaintext, plaintext_len );
+            memset ( master, '\0', sizeof ( master ) );
+            memset ( key, '\0', sizeof ( key ) );
+            memset ( mac_key, '\0', sizeof ( mac_key ) );
+            free_load_stream ( &stream );
+            return NULL;
         }
+
+        stream.src = stream.body;
     }
 
-    secure_free_mem ( compressed, encrypted_len );
+    memset ( mac_key, '\0', sizeof ( mac_key ) );
+    stream.cipher = header.cipher;
+    stream.encrypted_left = encrypted_len;
+    stream.compressed_left = encrypted_len;
+    memcpy ( stream.iv, iv, AES256_BLOCKLEN );
 
-    result = unpack_tree ( plaintext, plaintext_len );
-    secure_free_mem ( plaintext, plaintext_len );
+    if ( prefix_len )
+    {
+        stream.compressed_left = header.compressed_len;
+        stream.check_plaintext = TRUE;
+        stream.plaintext_left = header.plaintext_len;
+
+    } else if ( salt[0] & 0xf0 )
+    {
+        stream.compressed_left += ( ( salt[0] & 0xf0 ) >> 4 ) - AES256_BLOCKLEN;
+    }
+
+    if ( ( stream.cipher == CIPHER_AES256_CBC
+            && mbedtls_aes_setkey_dec ( &stream.aes, key, AES256_KEYLEN_BITS ) != 0 )
+        || !( stream.chunk = ( uint8_t * ) malloc ( stream.chunk_alloc ) )
+        || load_stream_next_chunk ( &stream ) < 0 )
+    {
+        memset ( master, '\0', sizeof ( master ) );
+        memset ( key, '\0', sizeof ( key ) );
+        free_load_stream ( &stream );
+        return NULL;
+    }
+
+    /* Only a verified password may replace the session key, segments check it on opening */
+    store_master_key ( password, salt, &header.kdf, master, key_epoch );
+    memset ( master, '\0', sizeof ( master ) );
+
+    if ( header.codec == CODEC_ZSTD )
+    {
+        if ( !( stream.zstd = ZSTD_createDCtx (  ) ) || ( header.dictionary
+                && ZSTD_isError ( ZSTD_DCtx_loadDictionary ( stream.zstd, zstd_dictionary,
+                        sizeof ( zstd_dictionary ) ) ) ) )
+        {
+            memset ( key, '\0', sizeof ( key ) );
+            free_load_stream ( &stream );
+            return NULL;
+        }
+
+        result = unpack_load_stream ( &stream, &header );
 
+    } else if ( stream.chunk_len >= LZ4F_FRAME_MAGIC_SIZE
+        && !memcmp ( stream.chunk, frame_magic, LZ4F_FRAME_MAGIC_SIZE ) )
+    {
+        if ( LZ4F_isError ( LZ4F_createDecompressionContext ( &stream.lz4, LZ4F_VERSION ) ) )
+        {
+            stream.lz4 = NULL;
+            memset ( key, '\0', sizeof ( key ) );
+            free_load_stream ( &stream );
+            return NULL;
+        }
+
+        result = unpack_load_stream ( &stream, &header );
+
+    } else if ( !stream.check_plaintext )
+    {
+        result = load_legacy_body ( &stream );
+
+    } else
+    {
+        errno = EINVAL;
+        result = NULL;
+    }
+
+    memset ( key, '\0', sizeof ( key ) );
+    free_load_stream ( &stream );
     return result;
 }
 
 struct node_t *load_database ( const char *path, const char *password )
 {
     int fd;
+    int mapped;
+    size_t len;
+    uint8_t *mem;
     struct node_t *database;
 
     if ( ( fd = open ( path, O_RDONLY ) ) < 0 )
@@ -288,127 +1453,282 @@ struct node_t *load_database ( const char *path, const char *password )
         return NULL;
     }
 
-    database = load_database_in ( fd, password[0] ? password : NULL );
+    if ( !( mem = read_file_in ( fd, &len, &mapped ) ) )
+    {
+        close ( fd );
+        return NULL;
+    }
+
     close ( fd );
+    database = load_database_in ( mem, len, password[0] ? password : NULL );
+    release_file_in ( mem, len, mapped );
     return database;
 }
 
-static int save_database_in ( int fd, const uint8_t * plaintext, size_t len, const char *password )
+static size_t zstd_compress_body ( uint8_t * dst, size_t dst_size, const uint8_t * src,
+    size_t len, int level )
+{
+    size_t ret;
+    ZSTD_CCtx *cctx;
+
+    if ( !( cctx = ZSTD_createCCtx (  ) ) )
+    {
+        return ( size_t ) -1;
+    }
+
+    if ( ZSTD_isError ( ret = ZSTD_CCtx_setParameter ( cctx, ZSTD_c_compressionLevel, level ) )
+        || ZSTD_isError ( ret = ZSTD_CCtx_loadDictionary ( cctx, zstd_dictionary,
+                sizeof ( zstd_dictionary ) ) ) )
+    {
+        ZSTD_freeCCtx ( cctx );
+        return ret;
+    }
+
+    ret = ZSTD_compress2 ( cctx, dst, dst_size, src, len );
+    ZSTD_freeCCtx ( cctx );
+    return ret;
+}
+
+static int save_database_in ( int fd, const uint8_t * plaintext, size_t len, const char *password,
+    unsigned int key_epoch )
 {
+    int ret;
+    int codec;
+    int level;
+    size_t tags_len;
+    uint8_t *tags = NULL;
+    struct segment_job_t segments = { 0 };
     size_t compressed_size;
     size_t compressed_len;
     uint8_t *compressed;
-    uint8_t *encrypted;
+    struct container_header_t header;
+    uint8_t prefix[CONTAINER_HEADER_SIZE + AES256_BLOCKLEN];
     uint8_t salt[AES256_KEYLEN];
+    uint8_t master[AES256_KEYLEN];
     uint8_t key[AES256_KEYLEN];
+    uint8_t mac_key[AES256_KEYLEN];
     uint8_t iv[AES256_BLOCKLEN];
     uint8_t hmac[SHA256_BLOCKLEN];
+    struct iovec iov[6];
+    LZ4F_preferences_t prefs;
 
     if ( !password )
     {
         return write_complete ( fd, plaintext, len ) < 0 ? -1 : 0;
     }
 
-    if ( random_bytes ( salt, sizeof ( salt ) ) < 0
+    codec = get_save_codec ( &level );
+    memset ( &prefs, '\0', sizeof ( prefs ) );
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.contentSize = len;
+    prefs.compressionLevel = level;
+
+    /* Keep the session salt so the cached master key stays valid */
+    if ( ( lookup_cached_salt ( password, salt, &header.kdf ) < 0
+            && ( random_bytes ( salt, sizeof ( salt ) ) < 0
+                || get_save_kdf_params ( &header.kdf ) < 0 ) )
         || random_bytes ( iv, sizeof ( iv ) ) < 0
-        || ( ssize_t ) ( compressed_size = LZ4_compressBound ( len ) ) < 0 )
+        || random_bytes ( header.nonce, sizeof ( header.nonce ) ) < 0 )
     {
         return -1;
     }
 
-    compressed_size += AES256_BLOCKLEN;
+    compressed_size = ( codec == CODEC_ZSTD ? ZSTD_compressBound ( len )
+        : LZ4F_compressFrameBound ( len, &prefs ) ) + AES256_BLOCKLEN;
 
     if ( !( compressed = ( uint8_t * ) malloc ( compressed_size ) ) )
     {
         return -1;
     }
 
-    if ( ( ssize_t ) ( compressed_len = LZ4_compress_default ( ( const char * ) plaintext,
-                ( char * ) compressed, len, compressed_size ) ) < 0 )
+    if ( codec == CODEC_ZSTD
+        ? ZSTD_isError ( compressed_len = zstd_compress_body ( compressed, compressed_size,
+                plaintext, len, level ) )
+        : LZ4F_isError ( compressed_len = LZ4F_compressFrame ( compressed, compressed_size,
+                plaintext, len, &prefs ) ) )
     {
         secure_free_mem ( compressed, compressed_size );
         return -1;
     }
 
-    salt[0] = ( ( compressed_len % AES256_BLOCKLEN ) << 4 ) | ( salt[0] & 0x0f );
+    header.version = CONTAINER_VERSION;
+    header.cipher = get_save_cipher (  );
+    header.segment_log2 = header.cipher != CIPHER_AES256_CBC ? SEGMENT_LOG2 : 0;
+    header.codec = codec;
+    header.dictionary = codec == CODEC_ZSTD ? ZSTD_DICTIONARY_ID : 0;
+    header.plaintext_len = len;
+    header.compressed_len = compressed_len;
+    memset ( hmac, '\0', sizeof ( hmac ) );
 
-    if ( pbkdf2_sha256_derive_key ( password, salt, sizeof ( salt ), key, sizeof ( key ) ) < 0 )
+    if ( header.cipher != CIPHER_AES256_CBC )
     {
-        secure_free_mem ( compressed, compressed_size );
-        return -1;
+        memset ( iv + AEAD_NONCE_LEN, '\0', sizeof ( iv ) - AEAD_NONCE_LEN );
     }
 
-    while ( compressed_len % AES256_BLOCKLEN )
-    {
-        compressed[compressed_len++] = '\0';
-    }
+    write_header ( &header, prefix );
+    memcpy ( prefix + CONTAINER_HEADER_SIZE, iv, sizeof ( iv ) );
+
+    tags_len = header.segment_log2
+        ? segment_count ( compressed_len, header.segment_log2 ) * AEAD_TAG_LEN : 0;
 
-    if ( !( encrypted = ( uint8_t * ) malloc ( compressed_len ) ) )
+    if ( tags_len && !( tags = ( uint8_t * ) malloc ( tags_len ) ) )
     {
-        memset ( key, '\0', sizeof ( key ) );
         secure_free_mem ( compressed, compressed_size );
         return -1;
     }
 
-    if ( aes256_cbc_encrypt ( key, iv, compressed_len, compressed, encrypted ) < 0 )
+    if ( derive_file_keys ( password, salt, &header, master, key, mac_key ) < 0 )
     {
-        memset ( key, '\0', sizeof ( key ) );
+        free ( tags );
         secure_free_mem ( compressed, compressed_size );
-        free ( encrypted );
         return -1;
     }
 
-    if ( hmac_sha256 ( key, sizeof ( key ), encrypted, compressed_len, hmac ) < 0 )
+    store_master_key ( password, salt, &header.kdf, master, key_epoch );
+    memset ( master, '\0', sizeof ( master ) );
+
+    if ( header.cipher == CIPHER_AES256_CBC )
     {
-        memset ( key, '\0', sizeof ( key ) );
-        secure_free_mem ( compressed, compressed_size );
-        free ( encrypted );
-        return -1;
+        while ( compressed_len % AES256_BLOCKLEN )
+        {
+            compressed[compressed_len++] = '\0';
+        }
+
+        ret = aes256_cbc_encrypt_then_mac ( key, mac_key, iv, prefix, sizeof ( prefix ),
+            compressed, compressed_len, hmac );
+    } else
+    {
+        segments.cipher = header.cipher;
+        segments.key = key;
+        segments.iv = iv;
+        segments.aad = prefix;
+        segments.aad_len = sizeof ( prefix );
+        segments.tags = tags;
+        segments.dst = compressed;
+        segments.len = compressed_len;
+        segments.segment_size = ( size_t ) 1 << header.segment_log2;
+        ret = parallel_run ( tags_len / AEAD_TAG_LEN, encrypt_segment, &segments );
     }
 
     memset ( key, '\0', sizeof ( key ) );
-    secure_free_mem ( compressed, compressed_size );
+    memset ( mac_key, '\0', sizeof ( mac_key ) );
+
+    if ( ret < 0 )
+    {
+        free ( tags );
+        secure_free_mem ( compressed, compressed_size );
+        return -1;
+    }
 
-    if ( write_complete ( fd, salt, sizeof ( salt ) ) < 0
-        || write_complete ( fd, hmac, sizeof ( hmac ) ) < 0
-        || write_complete ( fd, iv, sizeof ( iv ) ) < 0
-        || write_complete ( fd, encrypted, compressed_len ) < 0 )
+    iov[0].iov_base = prefix;
+    iov[0].iov_len = CONTAINER_HEADER_SIZE;
+    iov[1].iov_base = salt;
+    iov[1].iov_len = sizeof ( salt );
+    iov[2].iov_base = hmac;
+    iov[2].iov_len = sizeof ( hmac );
+    iov[3].iov_base = iv;
+    iov[3].iov_len = sizeof ( iv );
+    iov[4].iov_base = tags;
+    iov[4].iov_len = tags_len;
+    iov[5].iov_base = compressed;
+    iov[5].iov_len = compressed_len;
+
+    if ( writev_complete ( fd, iov, sizeof ( iov ) / sizeof ( struct iovec ) ) < 0 )
     {
-        free ( encrypted );
+        free ( tags );
+        secure_free_mem ( compressed, compressed_size );
         return -1;
     }
 
-    free ( encrypted );
+    free ( tags );
+    secure_free_mem ( compressed, compressed_size );
     return 0;
 }
 
-int save_database ( const char *path, struct node_t *node, const char *password )
+int save_packed_database ( const char *path, const uint8_t * packed, size_t packed_len,
+    const char *password, unsigned int key_epoch )
 {
-    int ret;
     int fd;
-    size_t packed_len;
-    uint8_t *packed;
+    int err;
+    int moved = FALSE;
+    struct stat st;
+    char temp_path[PATH_SIZE];
     char backup_path[PATH_SIZE];
 
-    if ( pack_tree ( node, &packed, &packed_len ) < 0 )
+    if ( ( size_t ) snprintf ( temp_path, sizeof ( temp_path ), "%s.XXXXXX",
+            path ) >= sizeof ( temp_path ) )
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    /* Write a sibling temp file and rename it over the database, so that
+       a crash leaves either the old or the new file in place */
+    if ( ( fd = mkstemp ( temp_path ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* The new file keeps the mode of the one it replaces, a new database
+       stays at the mkstemp 0600. fdatasync need not persist the mode. */
+    if ( ( stat ( path, &st ) >= 0 && fchmod ( fd, st.st_mode & 07777 ) < 0 )
+        || save_database_in ( fd, packed, packed_len, password[0] ? password : NULL,
+            key_epoch ) < 0 || fsync ( fd ) < 0 )
+    {
+        close ( fd );
+        unlink ( temp_path );
+        return -1;
+    }
+
+    if ( close ( fd ) < 0 )
     {
+        unlink ( temp_path );
         return -1;
     }
 
     snprintf ( backup_path, sizeof ( backup_path ), "%s.bak", path );
-    rename ( path, backup_path );
+    unlink ( backup_path );
 
-    if ( ( fd = open ( path, O_CREAT | O_TRUNC | O_WRONLY, 0644 ) ) < 0 )
+    /* Without hard links the database itself becomes the backup until replaced */
+    if ( link ( path, backup_path ) < 0 && errno != ENOENT )
+    {
+        moved = rename ( path, backup_path ) >= 0;
+    }
+
+    if ( rename ( temp_path, path ) < 0 )
+    {
+        err = errno;
+        if ( moved )
+        {
+            rename ( backup_path, path );
+        }
+        unlink ( temp_path );
+        errno = err;
+        return -1;
+    }
+
+    /* Some file systems cannot sync directories, the rename is all there is then */
+    if ( sync_parent_dir ( path ) < 0 && errno != EINVAL )
     {
-        secure_free_mem ( packed, packed_len );
         return -1;
     }
 
-    ret = save_database_in ( fd, packed, packed_len, password[0] ? password : NULL );
+    return 0;
+}
+
+int save_database ( const char *path, struct node_t *node, const char *password )
+{
+    int ret;
+    size_t packed_len;
+    uint8_t *packed;
+
+    if ( pack_tree ( node, &packed, &packed_len ) < 0 )
+    {
+        return -1;
+    }
 
+    ret = save_packed_database ( path, packed, packed_len, password, get_key_cache_epoch (  ) );
     secure_free_mem ( packed, packed_len );
-    syncfs ( fd );
-    close ( fd );
     return ret;
 }
 
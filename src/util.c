@@ -3,9 +3,26 @@
  * ------------------------------------------------------------------ */
 
 #include "util.h"
+#include "arena.h"
+#include <pthread.h>
+
+struct parallel_ctx_t
+{
+    pthread_mutex_t mutex;
+    size_t next;
+    size_t ntasks;
+    int failed;
+    int ( *task ) ( void *, size_t );
+    void *ctx;
+};
 
 void secure_free_mem ( void *mem, size_t size )
 {
+    if ( arena_release ( mem, size ) )
+    {
+        return;
+    }
+
     memset ( mem, '\0', size );
     free ( mem );
 }
@@ -18,6 +35,36 @@ void secure_free_string ( char *string )
     }
 }
 
+void *secure_alloc_locked ( size_t size )
+{
+    void *mem;
+
+    if ( ( mem = mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                0 ) ) == MAP_FAILED )
+    {
+        return NULL;
+    }
+
+    if ( mlock ( mem, size ) < 0 )
+    {
+        munmap ( mem, size );
+        return NULL;
+    }
+
+#ifdef MADV_DONTDUMP
+    madvise ( mem, size, MADV_DONTDUMP );
+#endif
+
+    return mem;
+}
+
+void secure_free_locked ( void *mem, size_t size )
+{
+    memset ( mem, '\0', size );
+    munlock ( mem, size );
+    munmap ( mem, size );
+}
+
 int random_bytes ( void *buffer, size_t length )
 {
     int fd;
@@ -41,3 +88,87 @@ int random_bytes ( void *buffer, size_t length )
     close ( fd );
     return 0;
 }
+
+static void *parallel_worker ( void *arg )
+{
+    size_t index;
+    struct parallel_ctx_t *parallel = ( struct parallel_ctx_t * ) arg;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock ( &parallel->mutex );
+        index = parallel->next++;
+        pthread_mutex_unlock ( &parallel->mutex );
+
+        if ( index >= parallel->ntasks )
+        {
+            break;
+        }
+
+        if ( parallel->task ( parallel->ctx, index ) < 0 )
+        {
+            pthread_mutex_lock ( &parallel->mutex );
+            parallel->failed = TRUE;
+            parallel->next = parallel->ntasks;
+            pthread_mutex_unlock ( &parallel->mutex );
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int parallel_run ( size_t ntasks, int ( *task ) ( void *, size_t ), void *ctx )
+{
+    long ncpus;
+    size_t i;
+    size_t nthreads;
+    size_t started;
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    struct parallel_ctx_t parallel;
+
+    ncpus = sysconf ( _SC_NPROCESSORS_ONLN );
+    nthreads = ncpus > 1 ? ( size_t ) ncpus : 1;
+
+    if ( nthreads > ntasks )
+    {
+        nthreads = ntasks;
+    }
+
+    if ( nthreads > PARALLEL_MAX_THREADS )
+    {
+        nthreads = PARALLEL_MAX_THREADS;
+    }
+
+    memset ( &parallel, '\0', sizeof ( parallel ) );
+    pthread_mutex_init ( &parallel.mutex, NULL );
+    parallel.ntasks = ntasks;
+    parallel.task = task;
+    parallel.ctx = ctx;
+
+    /* The calling thread is a worker too, so a failed spawn only costs speed */
+    for ( started = 0; started + 1 < nthreads; started++ )
+    {
+        if ( pthread_create ( &threads[started], NULL, parallel_worker, &parallel ) != 0 )
+        {
+            break;
+        }
+    }
+
+    parallel_worker ( &parallel );
+
+    for ( i = 0; i < started; i++ )
+    {
+        pthread_join ( threads[i], NULL );
+    }
+
+    pthread_mutex_destroy ( &parallel.mutex );
+
+    if ( parallel.failed )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}